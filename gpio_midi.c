@@ -4,12 +4,21 @@
 #endif
 #define __USE_GNU
 #include <sound/asequencer.h>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/ioctl.h>
 #include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <endian.h>
 #include <signal.h>
+#include <errno.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <string.h>
@@ -21,33 +30,302 @@
 #define UNUSED __attribute__((unused))
 #define PACKED __attribute__((packed))
 #define UNLIKELY(x) __builtin_expect(x, 0)
+#define JOURNAL_MAGIC "GMJOURN1"
+#define JOURNAL_SESSION UINT32_MAX
+#define HANDOVER_MAGIC "GMHAND01"
+#define HANDOVER_VERSION 2
+#define TELEMETRY_PATH "/dev/shm/" APP_NAME "-server"
+#define NO_DEVICE UINT32_MAX
+
+typedef struct {
+    uint64_t    ping_time;
+    uint64_t    play_time;
+    int64_t     offset;
+    uint8_t     samples;
+    uint8_t     next;
+    uint64_t    rtt[CONFIG_SYNC_SAMPLES];
+    int64_t     offsets[CONFIG_SYNC_SAMPLES];
+} clock_sync_t;
+
+typedef struct {
+    uint64_t    scan_time;
+    uint64_t    send_time;
+    uint32_t    start;
+} segment_t;
+
+typedef struct {
+    uint32_t    device;
+    uint16_t    features;
+    uint8_t     version;
+    uint8_t     channel;
+} protocol_t;
+
+// Live counters in shared memory, written by the daemon only. handover is the HANDOVER_VERSION it can
+// hand its clients over with, -u checks it before it asks
+typedef struct {
+    telemetry_header_t  header;
+    uint64_t            handover;
+    uint64_t            connections;
+    uint64_t            accepted;
+    uint64_t            events;
+    uint64_t            bytes_read;
+    uint64_t            partial_frames;
+    uint64_t            syscalls;
+    uint64_t            seq_writes;
+    uint64_t            seq_dropped;
+    uint64_t            seq_held;
+    uint64_t            reloads;
+    uint64_t            reload_failures;
+    uint64_t            reload_error;
+    hist_t              seq_write_time;
+} telemetry_t;
+
+static telemetry_t telemetry_fallback;
+
+static const telemetry_counter_t telemetry_counters[] = {
+    TELEMETRY_COUNTER("Connections open", connections, TELEMETRY_COUNT),
+    TELEMETRY_COUNTER("Connections accepted", accepted, TELEMETRY_COUNT),
+    TELEMETRY_COUNTER("Events", events, TELEMETRY_RATE),
+    TELEMETRY_COUNTER("Bytes read", bytes_read, TELEMETRY_RATE),
+    TELEMETRY_COUNTER("Partial frames", partial_frames, TELEMETRY_COUNT),
+    TELEMETRY_COUNTER("Syscalls", syscalls, TELEMETRY_COUNT),
+    TELEMETRY_COUNTER("Sequencer writes", seq_writes, TELEMETRY_COUNT),
+    TELEMETRY_COUNTER("Events dropped", seq_dropped, TELEMETRY_COUNT),
+    TELEMETRY_COUNTER("Events held back", seq_held, TELEMETRY_COUNT),
+    TELEMETRY_COUNTER("Reloads", reloads, TELEMETRY_COUNT),
+    TELEMETRY_COUNTER("Failed reloads", reload_failures, TELEMETRY_COUNT),
+    TELEMETRY_COUNTER("Last reload error", reload_error, TELEMETRY_CODE),
+    TELEMETRY_COUNTER("Seq write", seq_write_time, TELEMETRY_HIST),
+};
+
+typedef struct {
+    char        magic[8];
+    uint32_t    record_size;
+    uint32_t    reserved;
+} journal_header_t;
+
+// Records never straddle a segment, the header and the segment size are both multiples of a record. Each
+// recording starts with a JOURNAL_SESSION record, times after it run from a clock base of their own
+typedef struct {
+    uint64_t        time;
+    uint32_t        source;
+    uint8_t         channel;
+    uint8_t         reserved;
+    midi_event_t    event;
+} journal_record_t;
+
+typedef enum PACKED {
+    CLIENT_SOCKET,
+    SERVER_SOCKET,
+    UDP_SOCKET,
+} socket_type_t;
+
+// Slab slot, epoll hands it back through data.ptr; next links the free slots
+typedef struct connection {
+    struct connection * next;
+    int             fd;
+    socket_type_t   type;
+    protocol_t      protocol;
+    clock_sync_t    sync;
+    uint64_t        scan_time;
+    uint64_t        send_time;
+    uint16_t        fill;
+    uint8_t         closing;
+    uint8_t         notes[MIDI_NOTES / 8];
+    uint8_t         buffer[CONFIG_MAX_READ_SIZE];
+} connection_t;
+
+typedef struct {
+    protocol_t      protocol;
+    clock_sync_t    sync;
+    uint32_t        address;
+    uint16_t        port;
+    uint32_t        session;
+    uint32_t        sequence;
+    uint64_t        seen_time;
+    uint8_t         notes[MIDI_NOTES / 8];
+} udp_peer_t;
+
+// First message of an upgrade, it carries the listening, UDP and sequencer fds. Every client connection
+// follows in a message of its own with its fd, partial frame and clock sync included. The structs go
+// across as they are, so a build that lays them out differently is refused
+typedef struct {
+    char                magic[8];
+    uint32_t            version;
+    uint32_t            handover_size;
+    uint32_t            connection_size;
+    uint32_t            udp_peer_size;
+    uint32_t            count;
+    int                 seq_queue;
+    struct snd_seq_addr seq_port;
+    struct snd_seq_addr seq_connect;
+    udp_peer_t          udp_peers[CONFIG_MAX_UDP_PEERS];
+} handover_t;
+
+// A settings file route line, device NO_DEVICE stands for every device
+typedef struct {
+    uint32_t            device;
+    uint8_t             low;
+    uint8_t             high;
+    uint8_t             channel;
+    int8_t              transpose;
+    struct snd_seq_addr dest;
+} route_t;
+
+// One output event per target, channel MIDI_CHANNELS keeps the sender's channel
+typedef struct {
+    struct snd_seq_addr dest;
+    uint8_t             channel;
+    uint8_t             note;
+} route_target_t;
+
+typedef struct {
+    uint16_t            first;
+    uint16_t            count;
+} route_dispatch_t;
+
+// What SIGHUP can change, the loop swaps in a complete copy between batches. Routes are flattened into
+// one dispatch row per device, the last row serves every device without routes of its own
+typedef struct {
+    uint32_t            seq_batch;
+    uint64_t            flush_time;
+    struct snd_seq_addr seq_connect;
+    uint32_t            route_devices;
+    uint32_t            devices[CONFIG_MAX_ROUTE_DEVICES];
+    route_dispatch_t    dispatch[CONFIG_MAX_ROUTE_DEVICES + 1][MIDI_NOTES];
+    route_target_t      targets[CONFIG_MAX_ROUTE_TARGETS];
+} config_t;
+
+// Rings shared with the kernel, sq_tail and buf_tail run ahead locally until published
+typedef struct {
+    int                         fd;
+    uint32_t                    sq_entries;
+    uint32_t                    sq_mask;
+    uint32_t                    cq_mask;
+    uint32_t                    sq_tail;
+    uint32_t                    sq_submitted;
+    uint32_t                    armed;
+    uint8_t                     draining;
+    uint16_t                    buf_tail;
+    uint32_t *                  sq_head;
+    uint32_t *                  sq_ktail;
+    uint32_t *                  cq_head;
+    uint32_t *                  cq_tail;
+    struct io_uring_sqe *       sqes;
+    struct io_uring_cqe *       cqes;
+    struct io_uring_buf_ring *  buf_ring;
+    uint8_t *                   buffers;
+    void *                      ring_map;
+    uint32_t                    ring_size;
+} uring_t;
 
 typedef struct {
     const char *        log_path;
     const char *        pid_path;
     const char *        server_ip;
+    const char *        stats_path;
+    const char *        seq_path;
+    const char *        journal_path;
+    const char *        config_path;
+    const char *        handover_path;
+    int                 handover_fd;
+    const config_t *    config;
+    const char *        telemetry_path;
+    telemetry_t *       telemetry;
+    uint8_t *           journal_map;
+    uint8_t *           journal_next;
+    uint8_t *           journal_retired;
+    uint64_t            journal_size;
+    uint64_t            journal_segment;
+    int                 journal_fd;
     int                 epoll_fd;
     int                 server_fd;
+    int                 udp_fd;
     int                 seq_fd;
+    int                 seq_queue;
     short               server_port;
+    uint8_t             use_uring;
     struct snd_seq_addr seq_addr;
+    struct snd_seq_addr seq_port;
+    struct snd_seq_addr seq_connect;
+    struct snd_seq_addr seq_connected;
+    uint64_t            udp_sweep_time;
+    uint32_t            seq_batch;
+    uint32_t            seq_fill;
+    uint64_t            seq_time;
+    uint64_t            flush_time;
+    uint32_t            connection_count;
+    connection_t *      free_connections;
+    connection_t *      freed_connections;
+    connection_t *      listen_connection;
+    connection_t *      udp_connection;
+    uring_t             uring;
+    config_t            configs[2];
+    uint64_t            udp_lost;
+    uint64_t            udp_recovered;
+    uint64_t            udp_dropped;
+    uint64_t            queue_base;
+    uint64_t            playout_min;
+    uint64_t            playout_delay;
+    uint64_t            playout_late;
+    uint64_t            playout_window;
+    uint64_t            bench_syscalls;
+    uint64_t            bench_events;
+    uint64_t            bench_seq_writes;
+    const telemetry_t * bench_telemetry;
+    hist_t              playout_transit;
+    hist_t              total_latency;
+    hist_t              scan_latency;
+    hist_t              network_latency;
+    hist_t              seq_latency;
+    midi_event_t        midi_events[CONFIG_MAX_READ_SIZE / sizeof(midi_event_t)];
+    struct snd_seq_event seq_events[CONFIG_MAX_MIDI_EVENTS];
+    connection_t        connections[CONFIG_MAX_CONNECTIONS];
+    udp_peer_t          udp_peers[CONFIG_MAX_UDP_PEERS];
 } common_t;
 
 static common_t common = {
     .log_path           = APP_NAME ".log",
     .pid_path           = APP_NAME ".pid",
+    .handover_path      = APP_NAME ".sock",
+    .handover_fd        = -1,
     .server_ip          = NULL,
+    .stats_path         = APP_NAME ".stats",
+    .seq_path           = SND_SEQ,
+    .journal_path       = NULL,
+    .telemetry_path     = TELEMETRY_PATH,
+    .telemetry          = &telemetry_fallback,
+    .journal_map        = NULL,
+    .journal_next       = NULL,
+    .journal_retired    = NULL,
+    .journal_fd         = -1,
     .epoll_fd           = -1,
     .server_fd          = -1,
+    .udp_fd             = -1,
     .seq_fd             = -1,
+    .seq_queue          = -1,
+    .uring.fd           = -1,
+    .playout_min        = 0,
     .server_port        = 9001,
-    .seq_addr.client    = 14,
-    .seq_addr.port      = 0,
+    .seq_batch          = CONFIG_MAX_MIDI_EVENTS,
+    .flush_time         = CONFIG_SEQ_FLUSH_TIME * 1000ull,
+    .connection_count   = 0,
+    .free_connections   = NULL,
+    .freed_connections  = NULL,
+    .seq_addr.client    = SNDRV_SEQ_ADDRESS_SUBSCRIBERS,
+    .seq_addr.port      = SNDRV_SEQ_ADDRESS_UNKNOWN,
+    .seq_connect.client = SNDRV_SEQ_ADDRESS_UNKNOWN,
 };
 
+static volatile sig_atomic_t stats_requested = 0;
+static volatile sig_atomic_t reload_requested = 0;
+static volatile sig_atomic_t stats_reset = 0;
+static volatile sig_atomic_t handover_requested = 0;
+
 typedef enum PACKED {
     SUCCESS_ACTION_CODE,
     UNDEFINED_PROCESS_ACTION_CODE = -128,
+    INVALID_OPTION_ACTION_CODE,
 
     OPEN_LOG_FILE_ACTION_CODE,
     READ_LOG_FILE_ACTION_CODE,
@@ -55,10 +333,12 @@ typedef enum PACKED {
 
     SIGSEGV_ACTION_CODE,
     SIGTERM_ACTION_CODE,
+    HANDOVER_ACTION_CODE,
 
     OPEN_PID_FILE_ACTION_CODE,
     READ_PID_FILE_ACTION_CODE,
     WRITE_PID_FILE_ACTION_CODE,
+    STALE_PID_FILE_ACTION_CODE,
 
     FORK_ACTION_CODE,
     CREATE_SERVER_SOCKET_ACTION_CODE,
@@ -66,428 +346,2976 @@ typedef enum PACKED {
     LISTEN_SERVER_SOCKET_ACTION_CODE,
     EPOLL_CREATE_ACTION_CODE,
     EPOLL_ADD_SERVER_SOCKET_ACTION_CODE,
+    CREATE_UDP_SOCKET_ACTION_CODE,
+    BIND_UDP_SOCKET_ACTION_CODE,
+    EPOLL_ADD_UDP_SOCKET_ACTION_CODE,
     OPEN_SND_SEQ_ACTION_CODE,
+    SET_SEQ_CLIENT_ACTION_CODE,
+    CREATE_SEQ_PORT_ACTION_CODE,
+    SUBSCRIBE_SEQ_PORT_ACTION_CODE,
+    OPEN_CONFIG_FILE_ACTION_CODE,
+    READ_CONFIG_FILE_ACTION_CODE,
+    CREATE_SEQ_QUEUE_ACTION_CODE,
+    START_SEQ_QUEUE_ACTION_CODE,
+    OPEN_JOURNAL_FILE_ACTION_CODE,
+    READ_JOURNAL_FILE_ACTION_CODE,
+    MAP_JOURNAL_FILE_ACTION_CODE,
+    SETUP_URING_ACTION_CODE,
+    OPEN_HANDOVER_SOCKET_ACTION_CODE,
+    RECEIVE_HANDOVER_ACTION_CODE,
+    HANDOVER_VERSION_ACTION_CODE,
 
     EPOLL_WAIT_ACTION_CODE,
+    URING_ENTER_ACTION_CODE,
     ACCEPT_CLIENT_ACTION_CODE,
     EPOLL_ADD_CLIENT_SOCKET_ACTION_CODE,
     READ_EVENTS_ACTION_CODE,
     WRITE_SEQ_EVENTS_ACTION_CODE,
+    SEND_HANDOVER_ACTION_CODE,
 
     CONNECT_SERVER_ACTION_CODE,
     SEND_EVENTS_ACTION_CODE,
+    CLOSE_CLIENT_ACTION_CODE,
+    SIGNAL_PROCESS_ACTION_CODE,
+    OPEN_TELEMETRY_ACTION_CODE,
+    OPEN_STATS_FILE_ACTION_CODE,
+    READ_STATS_FILE_ACTION_CODE,
 } action_code_t;
 
-action_code_t main_loop(common_t * const restrict common) {
-    while (1) {
-        struct epoll_event events[CONFIG_MAX_EPOLL_EVENTS];
-        const int N = epoll_wait(common->epoll_fd, events, CONFIG_MAX_EPOLL_EVENTS, -1);
+typedef enum {
+    STANDARD_PROCESS,
+    VIEW_LOG_PROCESS,
+    VIEW_STATS_PROCESS,
+    QUIT_PROCESS,
+    UPGRADE_PROCESS,
+    TEST_PROCESS,
+    BENCH_PROCESS,
+    REPLAY_PROCESS,
+} process_t;
 
-        if (UNLIKELY(N < 0)) {
-            return EPOLL_WAIT_ACTION_CODE;
-        }
+#define DAEMON_SIGNALS SIGUSR2, SIGQUIT
+#include "gpio_midi_core.h"
 
-        for (int i = 0; i < N; i++) {
-            struct epoll_event * const restrict event = events + i;
-            const uint32_t epoll_events = event->events;
-            const int fd = event->data.fd;
+action_code_t write_stats(const common_t * const restrict common) {
+    char tmp_path[256];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", common->stats_path);
 
-            if (fd == common->server_fd) {
-                const int client_fd = accept4(fd, NULL, NULL, O_NONBLOCK);
+    const int stats_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP);
 
-                if (UNLIKELY(client_fd < 0)) {
-                    return ACCEPT_CLIENT_ACTION_CODE;
-                }
+    if (UNLIKELY(stats_fd < 0)) {
+        return OPEN_STATS_FILE_ACTION_CODE;
+    }
 
-                event->events = EPOLLIN | EPOLLET;
-                event->data.fd = client_fd;
+    write_hist(stats_fd, "Scan to seq", &common->total_latency);
+    write_hist(stats_fd, "Scan to send", &common->scan_latency);
+    write_hist(stats_fd, "Network", &common->network_latency);
+    write_hist(stats_fd, "Seq write", &common->seq_latency);
 
-                const int result = epoll_ctl(common->epoll_fd, EPOLL_CTL_ADD, client_fd, event);
+    dprintf(stats_fd, "Playout: delay %llu us, %llu late\n",
+        (unsigned long long)(common->playout_delay / 1000),
+        (unsigned long long)common->playout_late);
 
-                if (UNLIKELY(result < 0)) {
-                    return EPOLL_ADD_CLIENT_SOCKET_ACTION_CODE;
-                }
-            } else if (epoll_events & EPOLLIN) {
-                midi_event_t midi_events[CONFIG_MAX_MIDI_EVENTS];
-                int result = read(fd, midi_events, sizeof(midi_events));
+    dprintf(stats_fd, "UDP datagrams: %llu lost, %llu recovered, %llu dropped\n",
+        (unsigned long long)common->udp_lost,
+        (unsigned long long)common->udp_recovered,
+        (unsigned long long)common->udp_dropped);
 
-                if (UNLIKELY(result <= 0)) {
-                    continue;
-                }
+    dprintf(stats_fd, "Backend: %s\n", (common->uring.fd >= 0 ? "io_uring" : "epoll"));
 
-                result /= sizeof(midi_event_t);
-                struct snd_seq_event seq_events[result];
+    close(stats_fd);
+    rename(tmp_path, common->stats_path);
 
-                for (int i = 0; i < result; i++) {
-                    const midi_event_t * const restrict event = midi_events + i;
-                    struct snd_seq_event * const restrict seq_event = seq_events + i;
+    return SUCCESS_ACTION_CODE;
+}
 
-                    memset(seq_event, 0, sizeof(seq_event[0]));
+void reset_stats(common_t * const restrict common) {
+    memset(&common->total_latency, 0, sizeof(hist_t));
+    memset(&common->scan_latency, 0, sizeof(hist_t));
+    memset(&common->network_latency, 0, sizeof(hist_t));
+    memset(&common->seq_latency, 0, sizeof(hist_t));
 
-                    seq_event->type = (event->velocity > 0 ? SNDRV_SEQ_EVENT_NOTEON : SNDRV_SEQ_EVENT_NOTEOFF);
-                    seq_event->flags = SNDRV_SEQ_EVENT_LENGTH_FIXED;
-                    seq_event->queue = SNDRV_SEQ_QUEUE_DIRECT;
-                    seq_event->dest = common->seq_addr;
+    common->playout_late = 0;
+    common->udp_lost = 0;
+    common->udp_recovered = 0;
+    common->udp_dropped = 0;
+}
 
-                    seq_event->data.note.channel = 0;
-                    seq_event->data.note.note = event->key;
-                    seq_event->data.note.velocity = event->velocity;
-                }
+// Keeps the offset of the lowest round trip among the last few pongs
+void sync_clock(clock_sync_t * const restrict sync, const midi_sync_t * const restrict pong, const uint64_t now) {
+    const uint64_t server_time = be64toh(pong->server_time);
+    const uint64_t client_time = be64toh(pong->client_time);
 
-                const int seq_events_size = result * sizeof(struct snd_seq_event);
-                result = write(common->seq_fd, seq_events, seq_events_size);
+    if (UNLIKELY(server_time > now)) {
+        return;
+    }
 
-                if (UNLIKELY(result != seq_events_size)) {
-                    return WRITE_SEQ_EVENTS_ACTION_CODE;
-                }
-            } else {
-                close(fd);
-            }
+    const uint64_t rtt = now - server_time;
+    const uint8_t next = sync->next;
+
+    sync->rtt[next] = rtt;
+    sync->offsets[next] = (int64_t)(client_time - server_time - rtt / 2);
+    sync->next = (next + 1) % CONFIG_SYNC_SAMPLES;
+
+    if (sync->samples < CONFIG_SYNC_SAMPLES) {
+        sync->samples++;
+    }
+
+    uint8_t best = 0;
+
+    for (uint8_t i = 1; i < sync->samples; i++) {
+        if (sync->rtt[i] < sync->rtt[best]) {
+            best = i;
         }
     }
-}
 
-action_code_t init_server(common_t * const restrict common) {
-    const int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+    sync->offset = sync->offsets[best];
+}
 
-    if (UNLIKELY(server_fd < 0)) {
-        return CREATE_SERVER_SOCKET_ACTION_CODE;
-    } else {
-        common->server_fd = server_fd;
+static inline uint8_t ping_due(clock_sync_t * const restrict sync, midi_sync_t * const restrict ping, const uint64_t now) {
+    if (now - sync->ping_time < CONFIG_PING_INTERVAL) {
+        return 0;
     }
 
-    struct sockaddr_in sockaddr = {
-        .sin_family         = AF_INET,
-        .sin_port           = htons(common->server_port),
-        .sin_addr.s_addr    = htonl(INADDR_ANY),
+    sync->ping_time = now;
+
+    *ping = (const midi_sync_t) {
+        .frame.type     = MIDI_FRAME_PING,
+        .frame.size     = htons(sizeof(midi_sync_t) - sizeof(midi_frame_t)),
+        .server_time    = htobe64(now),
+        .client_time    = 0,
     };
 
-    const char * const server_ip = common->server_ip;
+    return 1;
+}
 
-    if (server_ip != NULL) {
-        inet_pton(AF_INET, server_ip, &sockaddr.sin_addr);
+void record_latency(common_t * const restrict common, const clock_sync_t * const restrict sync,
+                    const segment_t * const restrict segment, const uint32_t count,
+                    const uint64_t recv_time, const uint64_t done_time) {
+    if (count == 0 || segment->scan_time == 0) {
+        return;
     }
 
-    int result = bind(server_fd, (struct sockaddr *)&sockaddr, sizeof(sockaddr));
+    hist_add_n(&common->scan_latency, segment->send_time - segment->scan_time, count);
+    hist_add_n(&common->seq_latency, done_time - recv_time, count);
 
-    if (UNLIKELY(result < 0)) {
-        return BIND_SERVER_SOCKET_ACTION_CODE;
+    if (sync->samples == 0) {
+        return;
     }
 
-    result = listen(server_fd, SOMAXCONN);
+    const int64_t network = recv_time - (segment->send_time - sync->offset);
+    const int64_t total = done_time - (segment->scan_time - sync->offset);
 
-    if (UNLIKELY(result < 0)) {
-        return LISTEN_SERVER_SOCKET_ACTION_CODE;
+    hist_add_n(&common->network_latency, (network > 0 ? network : 0), count);
+    hist_add_n(&common->total_latency, (total > 0 ? total : 0), count);
+}
+
+void negotiate(protocol_t * const restrict protocol, const midi_hello_t * const restrict hello,
+               midi_hello_t * const restrict welcome) {
+    const uint16_t features = ntohs(hello->features) & MIDI_FEATURES;
+
+    protocol->version = (hello->version < MIDI_PROTOCOL_VERSION ? hello->version : MIDI_PROTOCOL_VERSION);
+    protocol->features = features;
+    protocol->device = (features & MIDI_FEATURE_DEVICE ? ntohl(hello->device) : 0);
+    protocol->channel = (features & MIDI_FEATURE_DEVICE ? hello->channel % MIDI_CHANNELS : 0);
+
+    *welcome = (const midi_hello_t) {
+        .frame.type     = MIDI_FRAME_WELCOME,
+        .frame.size     = htons(sizeof(midi_hello_t) - sizeof(midi_frame_t)),
+        .version        = protocol->version,
+        .channel        = protocol->channel,
+        .features       = htons(features),
+        .device         = htonl(protocol->device),
+    };
+}
+
+// Queue time runs from the queue start, base is that start on the monotonic clock
+void sync_queue(common_t * const restrict common) {
+    struct snd_seq_queue_status status = {
+        .queue  = common->seq_queue,
+    };
+
+    if (ioctl(common->seq_fd, SNDRV_SEQ_IOCTL_GET_QUEUE_STATUS, &status) == 0) {
+        common->queue_base = get_time_ns() - (status.time.tv_sec * 1000000000ull + status.time.tv_nsec);
     }
+}
 
-    const int epoll_fd = epoll_create(1);
+// Each window the delay jumps up to the transit p99.9 plus a margin, or creeps down towards it
+void tune_playout(common_t * const restrict common, const uint64_t now) {
+    hist_t * const restrict transit = &common->playout_transit;
 
-    if (UNLIKELY(epoll_fd < 0)) {
-        return EPOLL_CREATE_ACTION_CODE;
-    } else {
-        common->epoll_fd = epoll_fd;
+    if (now - common->playout_window < CONFIG_PLAYOUT_WINDOW) {
+        return;
     }
 
-    struct epoll_event event = {
-        .events     = EPOLLIN,
-        .data.fd    = server_fd,
-    };
+    if (transit->count > 0) {
+        uint64_t target = hist_percentile(transit, 9990) + CONFIG_PLAYOUT_MARGIN;
+        target = (target < common->playout_min ? common->playout_min : target);
+        target = (target > CONFIG_PLAYOUT_MAX ? CONFIG_PLAYOUT_MAX : target);
 
-    result = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &event);
+        common->playout_delay = (target > common->playout_delay ? target :
+            common->playout_delay - (common->playout_delay - target) / 8);
+    }
 
-    if (UNLIKELY(result < 0)) {
-        return EPOLL_ADD_SERVER_SOCKET_ACTION_CODE;
+    memset(transit, 0, sizeof(*transit));
+    common->playout_window = now;
+    sync_queue(common);
+}
+
+// Server clock time to play a segment at, 0 sends it straight away; a late segment plays now,
+// but never ahead of what the same peer already has queued so a note-off can't overtake its note-on
+uint64_t playout_time(common_t * const restrict common, clock_sync_t * const restrict sync,
+                      const uint64_t scan_time, const uint64_t recv_time, const uint32_t count) {
+    if (common->seq_queue < 0 || sync->samples == 0 || scan_time == 0 || count == 0) {
+        return 0;
     }
 
-    result = open(SND_SEQ, O_WRONLY);
+    const uint64_t scan = scan_time - sync->offset;
+    const uint64_t now = get_time_ns();
+    uint64_t play = scan + common->playout_delay;
 
-    if (UNLIKELY(result < 0)) {
-        return OPEN_SND_SEQ_ACTION_CODE;
-    } else {
-        common->seq_fd = result;
+    hist_add_n(&common->playout_transit, (recv_time > scan ? recv_time - scan : 0), count);
+    tune_playout(common, recv_time);
+
+    if (play <= now) {
+        common->playout_late += count;
+        play = now;
     }
 
-    return main_loop(common);
-}
+    play = (play > sync->play_time ? play : sync->play_time);
+    sync->play_time = play;
 
-action_code_t quit_proc(const common_t * const restrict common) {
-    const int pid_fd = open(common->pid_path, O_RDONLY);
+    return play;
+}
 
-    if (UNLIKELY(pid_fd < 0)) {
-        return OPEN_PID_FILE_ACTION_CODE;
+// Events from every connection ready in one loop wakeup share the buffer and go out in one write. A short
+// write is carried on from where it stopped. The sequencer stops at the first event it can't deliver, a
+// destination that went away say, so that event alone is dropped and the ones after it written again. A
+// full sequencer pool is backpressure instead, what is left stays in the buffer for the next flush
+action_code_t flush_seq(common_t * const restrict common) {
+    const uint32_t size = common->seq_fill * sizeof(struct snd_seq_event);
+    uint8_t * const restrict seq_events = (uint8_t *)common->seq_events;
+    uint32_t done = 0;
+    uint32_t writes = 0;
+    uint8_t full = 0;
+
+    if (size == 0) {
+        return SUCCESS_ACTION_CODE;
     }
 
-    pid_t pid;
-    const int result = read(pid_fd, &pid, sizeof(pid));
-    close(pid_fd);
+    const uint64_t write_time = get_time_ns();
+
+    while (done < size) {
+        const int result = write(common->seq_fd, seq_events + done, size - done);
+        writes++;
+
+        if (result > 0) {
+            done += result;
+        } else if (result < 0 && errno == EINTR) {
+            continue;
+        } else if (result < 0 && done % sizeof(struct snd_seq_event) == 0 &&
+                   (errno == ENOENT || errno == ENXIO || errno == EPERM)) {
+            counter_add(&common->telemetry->seq_dropped, 1);
+            done += sizeof(struct snd_seq_event);
+        } else {
+            full = (result < 0 && done % sizeof(struct snd_seq_event) == 0 && (errno == ENOMEM || errno == EAGAIN));
+            break;
+        }
+    }
 
-    if (UNLIKELY(result != sizeof(pid))) {
-        return READ_PID_FILE_ACTION_CODE;
+    hist_add_n(&common->telemetry->seq_write_time, get_time_ns() - write_time, done / sizeof(struct snd_seq_event));
+    counter_add(&common->telemetry->syscalls, writes);
+    counter_add(&common->telemetry->seq_writes, writes);
+    common->seq_fill = 0;
+
+    if (full) {
+        memmove(seq_events, seq_events + done, size - done);
+        common->seq_fill = (size - done) / sizeof(struct snd_seq_event);
+        counter_add(&common->telemetry->seq_held, common->seq_fill);
+    } else if (UNLIKELY(done < size)) {
+        return WRITE_SEQ_EVENTS_ACTION_CODE;
     }
 
-    kill(pid, SIGTERM);
     return SUCCESS_ACTION_CODE;
 }
 
-action_code_t view_log(const common_t * const restrict common) {
-    const int log_fd = open(common->log_path, O_RDONLY);
+// Bounds the wait of the oldest buffered event while a long wakeup is still reading other connections
+static inline action_code_t flush_due(common_t * const restrict common) {
+    if (common->seq_fill == 0 || get_time_ns() - common->seq_time < common->config->flush_time) {
+        return SUCCESS_ACTION_CODE;
+    }
+
+    return flush_seq(common);
+}
 
-    if (UNLIKELY(log_fd < 0)) {
-        return OPEN_LOG_FILE_ACTION_CODE;
+static inline const route_dispatch_t * route_row(const config_t * const restrict config, const uint32_t device) {
+    uint32_t row = 0;
+
+    while (row < config->route_devices && config->devices[row] != device) {
+        row++;
     }
 
-    action_code_t action_code;
-    const int result = read(log_fd, &action_code, sizeof(action_code));
-    close(log_fd);
+    return config->dispatch[row];
+}
+
+// Every event fans out to the targets of its note into the shared buffer, the loop flushes it
+action_code_t write_events(common_t * const restrict common, const midi_event_t * const restrict midi_events,
+                           const uint32_t count, const protocol_t * const restrict protocol, const uint64_t play_time) {
+    const config_t * const restrict config = common->config;
+    const route_dispatch_t * const restrict dispatch = route_row(config, protocol->device);
+    const uint32_t seq_batch = config->seq_batch;
+    const uint64_t queue_time = (play_time > common->queue_base ? play_time - common->queue_base : 0);
+
+    const struct snd_seq_real_time time = {
+        .tv_sec     = queue_time / 1000000000,
+        .tv_nsec    = queue_time % 1000000000,
+    };
+
+    const uint8_t queue = (play_time != 0 ? common->seq_queue : SNDRV_SEQ_QUEUE_DIRECT);
+    const uint8_t flags = SNDRV_SEQ_EVENT_LENGTH_FIXED |
+        (play_time != 0 ? SNDRV_SEQ_TIME_STAMP_REAL | SNDRV_SEQ_TIME_MODE_ABS : 0);
+    uint32_t written = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        const midi_event_t * const restrict event = midi_events + i;
+        const route_dispatch_t entry = dispatch[event->key % MIDI_NOTES];
+        const uint8_t type = SNDRV_SEQ_EVENT_NOTEON + (event->velocity == 0);
+
+        if (common->seq_fill == 0 && entry.count != 0) {
+            common->seq_time = get_time_ns();
+        }
+
+        for (uint32_t j = 0; j < entry.count; j++) {
+            const route_target_t * const restrict target = config->targets + entry.first + j;
+            struct snd_seq_event * const restrict seq_event = common->seq_events + common->seq_fill++;
+
+            seq_event->flags = flags;
+            seq_event->queue = queue;
+            seq_event->time.time = time;
+            seq_event->type = type;
+            seq_event->dest = target->dest;
+            seq_event->data.note.channel = (target->channel < MIDI_CHANNELS ? target->channel : protocol->channel);
+            seq_event->data.note.note = target->note;
+            seq_event->data.note.velocity = event->velocity;
+
+            // Held back events can only wait while there is room behind them
+            if (common->seq_fill >= seq_batch) {
+                const action_code_t action_code = flush_seq(common);
+
+                if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+                    return action_code;
+                }
+
+                if (UNLIKELY(common->seq_fill == CONFIG_MAX_MIDI_EVENTS)) {
+                    return WRITE_SEQ_EVENTS_ACTION_CODE;
+                }
+            }
+        }
 
-    if (UNLIKELY(result != sizeof(action_code))) {
-        return READ_LOG_FILE_ACTION_CODE;
+        written += entry.count;
     }
 
-    printf("Log: %d\n", action_code);
+    counter_add(&common->telemetry->events, written);
+
     return SUCCESS_ACTION_CODE;
 }
 
-action_code_t destroy(const action_code_t action_code) {
-    unlink(common.pid_path);
+// Grows the file a segment at a time to cover the one starting at segment
+static void * map_segment(const common_t * const restrict common, const uint64_t segment) {
+    struct stat stat;
 
-    if (common.seq_fd >= 0) {
-        close(common.seq_fd);
+    if (UNLIKELY(fstat(common->journal_fd, &stat) < 0)) {
+        return MAP_FAILED;
     }
 
-    if (common.server_fd >= 0) {
-        close(common.server_fd);
+    if ((uint64_t)stat.st_size < segment + CONFIG_JOURNAL_SEGMENT &&
+        UNLIKELY(ftruncate(common->journal_fd, segment + CONFIG_JOURNAL_SEGMENT) < 0)) {
+        return MAP_FAILED;
     }
 
-    if (common.epoll_fd >= 0) {
-        close(common.epoll_fd);
-    }
+    return mmap(NULL, CONFIG_JOURNAL_SEGMENT, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, common->journal_fd, segment);
+}
 
-    const int log_fd = open(common.log_path,
-        O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP);
+// Maps the segment holding offset
+action_code_t map_journal(common_t * const restrict common, const uint64_t offset) {
+    const uint64_t segment = offset / CONFIG_JOURNAL_SEGMENT * CONFIG_JOURNAL_SEGMENT;
 
-    if (UNLIKELY(log_fd < 0)) {
-        return OPEN_LOG_FILE_ACTION_CODE;
+    if (common->journal_map != NULL) {
+        munmap(common->journal_map, CONFIG_JOURNAL_SEGMENT);
+        common->journal_map = NULL;
     }
 
-    const int result = write(log_fd, &action_code, sizeof(action_code));
-    close(log_fd);
+    void * const map = map_segment(common, segment);
 
-    if (UNLIKELY(result != sizeof(action_code))) {
-        return WRITE_LOG_FILE_ACTION_CODE;
+    if (UNLIKELY(map == MAP_FAILED)) {
+        return MAP_JOURNAL_FILE_ACTION_CODE;
     }
 
+    common->journal_map = map;
+    common->journal_segment = segment;
+
     return SUCCESS_ACTION_CODE;
 }
 
-void sig_proc(const int code) {
-    switch (code) {
-        case SIGSEGV: return (void)destroy(SIGSEGV_ACTION_CODE);
-        case SIGTERM: return (void)destroy(SIGTERM_ACTION_CODE);
+// Run between batches. Once a segment is half full the next one is grown and mapped, so the event path
+// only swaps pointers at the boundary; the segment it leaves behind is unmapped here as well
+void prepare_journal(common_t * const restrict common) {
+    if (common->journal_retired != NULL) {
+        munmap(common->journal_retired, CONFIG_JOURNAL_SEGMENT);
+        common->journal_retired = NULL;
     }
+
+    if (common->journal_map == NULL || common->journal_next != NULL ||
+        common->journal_size - common->journal_segment < CONFIG_JOURNAL_SEGMENT / 2) {
+        return;
+    }
+
+    void * const map = map_segment(common, common->journal_segment + CONFIG_JOURNAL_SEGMENT);
+    common->journal_next = (map != MAP_FAILED ? map : NULL);
 }
 
-action_code_t init(common_t * const restrict common) {
-    pid_t pid = fork();
+// Appends to an existing journal, skipping the zeroed tail a crash leaves behind
+action_code_t open_journal(common_t * const restrict common) {
+    const int journal_fd = open(common->journal_path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP);
+
+    if (UNLIKELY(journal_fd < 0)) {
+        return OPEN_JOURNAL_FILE_ACTION_CODE;
+    } else {
+        common->journal_fd = journal_fd;
+    }
+
+    struct stat stat;
+    fstat(journal_fd, &stat);
+
+    uint64_t size = stat.st_size / sizeof(journal_record_t) * sizeof(journal_record_t);
+    size = (size < sizeof(journal_header_t) ? 0 : size);
 
-    if (pid == SUCCESS_ACTION_CODE) {
-        signal(SIGSEGV, sig_proc);
-        signal(SIGINT, sig_proc);
-        signal(SIGPIPE, SIG_IGN);
-        signal(SIGHUP, SIG_IGN);
+    const action_code_t action_code = map_journal(common, (size > 0 ? size - 1 : 0));
 
-        close(STDERR_FILENO);
-        close(STDOUT_FILENO);
-        close(STDIN_FILENO);
+    if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+        return action_code;
+    }
+
+    journal_header_t * const restrict header = (journal_header_t *)common->journal_map;
+
+    if (size == 0) {
+        memcpy(header->magic, JOURNAL_MAGIC, sizeof(header->magic));
+        header->record_size = sizeof(journal_record_t);
+        size = sizeof(journal_header_t);
+    } else if (common->journal_segment == 0 && memcmp(header->magic, JOURNAL_MAGIC, sizeof(header->magic)) != 0) {
+        return READ_JOURNAL_FILE_ACTION_CODE;
+    }
 
-        return destroy(init_server(common));
-    } else if (pid > 0) {
-        const int pid_fd = open(common->pid_path,
-            O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP);
+    // A whole segment grown ahead of time may be zeroed too
+    while (size > sizeof(journal_header_t)) {
+        if (size <= common->journal_segment) {
+            const action_code_t action_code = map_journal(common, size - 1);
 
-        if (UNLIKELY(pid_fd < 0)) {
-            return OPEN_PID_FILE_ACTION_CODE;
+            if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+                return action_code;
+            }
         }
 
-        const int result = write(pid_fd, &pid, sizeof(pid));
-        close(pid_fd);
+        const journal_record_t * const restrict record =
+            (const journal_record_t *)(common->journal_map + size - common->journal_segment) - 1;
 
-        if (UNLIKELY(result != sizeof(pid))) {
-            kill(pid, SIGTERM);
-            return WRITE_PID_FILE_ACTION_CODE;
+        if (record->time != 0) {
+            break;
         }
 
-        return SUCCESS_ACTION_CODE;
+        size -= sizeof(journal_record_t);
     }
 
-    return FORK_ACTION_CODE;
+    common->journal_size = size;
+    return SUCCESS_ACTION_CODE;
 }
 
-action_code_t test(common_t * const restrict common, const uint8_t key) {
-    const int server_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+void close_journal(common_t * const restrict common) {
+    uint8_t ** const maps[] = { &common->journal_map, &common->journal_next, &common->journal_retired };
 
-    if (UNLIKELY(server_fd < 0)) {
-        return CREATE_SERVER_SOCKET_ACTION_CODE;
+    for (uint32_t i = 0; i < sizeof(maps) / sizeof(maps[0]); i++) {
+        if (*maps[i] != NULL) {
+            munmap(*maps[i], CONFIG_JOURNAL_SEGMENT);
+            *maps[i] = NULL;
+        }
     }
 
-    struct sockaddr_in sockaddr = {
-        .sin_family         = AF_INET,
-        .sin_port           = htons(common->server_port),
-        .sin_addr.s_addr    = htonl(INADDR_LOOPBACK),
-    };
+    if (common->journal_fd >= 0) {
+        ftruncate(common->journal_fd, common->journal_size);
+        close(common->journal_fd);
+        common->journal_fd = -1;
+    }
+}
 
-    const char * const server_ip = common->server_ip;
+// Stores only, a full segment gives way to the one prepare_journal() mapped. Without one it is mapped here,
+// recording stops if that fails
+static inline void journal_events(common_t * const restrict common, const uint32_t source, const uint8_t channel,
+                                  const uint64_t time, const midi_event_t * const restrict midi_events,
+                                  const uint32_t count) {
+    if (common->journal_map == NULL) {
+        return;
+    }
 
-    if (server_ip != NULL) {
-        inet_pton(AF_INET, server_ip, &sockaddr.sin_addr);
+    for (uint32_t i = 0; i < count; i++) {
+        if (UNLIKELY(common->journal_size - common->journal_segment == CONFIG_JOURNAL_SEGMENT)) {
+            if (common->journal_next != NULL) {
+                common->journal_retired = common->journal_map;
+                common->journal_map = common->journal_next;
+                common->journal_next = NULL;
+                common->journal_segment += CONFIG_JOURNAL_SEGMENT;
+            } else if (map_journal(common, common->journal_size) != SUCCESS_ACTION_CODE) {
+                return;
+            }
+        }
+
+        journal_record_t * const restrict record =
+            (journal_record_t *)(common->journal_map + common->journal_size - common->journal_segment);
+
+        *record = (const journal_record_t) {
+            .time       = time,
+            .source     = source,
+            .channel    = channel,
+            .event      = midi_events[i],
+        };
+
+        common->journal_size += sizeof(journal_record_t);
     }
+}
 
-    int result = connect(server_fd, (struct sockaddr *)&sockaddr, sizeof(sockaddr));
+// Appends to the journal behind a session record of this process's own
+action_code_t start_journal(common_t * const restrict common) {
+    const action_code_t action_code = open_journal(common);
 
-    if (UNLIKELY(result < 0)) {
-        return CONNECT_SERVER_ACTION_CODE;
+    if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+        return action_code;
     }
 
-    midi_event_t event = {
-        .key        = key,
-        .velocity   = 100,
-    };
+    const midi_event_t session = { 0 };
+    journal_events(common, JOURNAL_SESSION, 0, get_time_ns(), &session, 1);
+
+    return SUCCESS_ACTION_CODE;
+}
+
+// For events with no scan time of their own, straight away unless the peer still has events queued
+static inline uint64_t catch_up_time(const common_t * const restrict common, const clock_sync_t * const restrict sync) {
+    const uint64_t now = get_time_ns();
+
+    return (common->seq_queue >= 0 && sync->play_time > now ? sync->play_time : 0);
+}
 
-    result = write(server_fd, &event, sizeof(event));
+// One bit per note a source has down
+static inline void track_notes(uint8_t * const restrict notes, const midi_event_t * const restrict midi_events,
+                               const uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t key = midi_events[i].key % MIDI_NOTES;
+        const uint8_t bit = 1 << (key % 8);
 
-    if (UNLIKELY(result != sizeof(event))) {
-        close(server_fd);
-        return SEND_EVENTS_ACTION_CODE;
+        notes[key / 8] = (midi_events[i].velocity > 0 ? notes[key / 8] | bit : notes[key / 8] & ~bit);
     }
+}
 
-    event.velocity = 0;
-    sleep(CONFIG_TEST_KEY_TIMEOUT);
+// The notes a source still holds are let go through the routes in use, after anything it has queued
+void release_notes(common_t * const restrict common, const uint32_t source, uint8_t * const restrict notes,
+                   const protocol_t * const restrict protocol, const clock_sync_t * const restrict sync) {
+    uint32_t count = 0;
+    midi_event_t midi_events[MIDI_NOTES];
+
+    for (uint32_t i = 0; i < MIDI_NOTES / 8; i++) {
+        for (uint8_t held = notes[i]; held != 0; held &= held - 1) {
+            midi_events[count++] = (const midi_event_t) {
+                .key        = i * 8 + __builtin_ctz(held),
+                .velocity   = 0,
+            };
+        }
 
-    result = write(server_fd, &event, sizeof(event));
-    close(server_fd);
+        notes[i] = 0;
+    }
 
-    if (UNLIKELY(result != sizeof(event))) {
-        return SEND_EVENTS_ACTION_CODE;
+    if (count == 0) {
+        return;
     }
 
-    return SUCCESS_ACTION_CODE;
+    journal_events(common, source, protocol->channel, get_time_ns(), midi_events, count);
+    write_events(common, midi_events, count, protocol, catch_up_time(common, sync));
+}
+
+static inline void release_udp_peer(common_t * const restrict common, udp_peer_t * const restrict peer) {
+    release_notes(common, CONFIG_MAX_CONNECTIONS + (peer - common->udp_peers), peer->notes, &peer->protocol,
+        &peer->sync);
+}
+
+// A free slot has no address
+static inline void drop_udp_peer(common_t * const restrict common, udp_peer_t * const restrict peer) {
+    release_udp_peer(common, peer);
+    memset(peer, 0, sizeof(*peer));
 }
 
-uint8_t get_key(const char * const restrict arg) {
-    uint8_t key = 0;
+// Peers quiet for longer than the timeout are let go, looked at once a ping interval as datagrams come in
+void expire_udp_peers(common_t * const restrict common, const uint64_t now) {
+    if (now - common->udp_sweep_time < CONFIG_PING_INTERVAL) {
+        return;
+    }
+
+    common->udp_sweep_time = now;
+
+    for (uint32_t i = 0; i < CONFIG_MAX_UDP_PEERS; i++) {
+        udp_peer_t * const restrict peer = common->udp_peers + i;
 
-    switch (arg[0]) {
-        case 'C': key = 0; break;
-        case 'D': key = 2; break;
-        case 'E': key = 4; break;
-        case 'F': key = 5; break;
-        case 'G': key = 7; break;
-        case 'A': key = 9; break;
-        case 'B': key = 11; break;
+        if (peer->address != 0 && now - peer->seen_time > CONFIG_UDP_PEER_TIMEOUT * 1000000000ull) {
+            drop_udp_peer(common, peer);
+        }
     }
+}
 
-    char next_c = arg[2];
+udp_peer_t * find_udp_peer(common_t * const restrict common, const struct sockaddr_in * const restrict sockaddr) {
+    for (uint32_t i = 0; i < CONFIG_MAX_UDP_PEERS; i++) {
+        udp_peer_t * const restrict peer = common->udp_peers + i;
 
-    switch (arg[1]) {
-        case '#': key++; break;
-        case 'b': key--; break;
-        default: next_c = arg[1];
+        if (peer->address == sockaddr->sin_addr.s_addr && peer->port == sockaddr->sin_port) {
+            return peer;
+        }
     }
 
-    return key + (next_c - '0') * 12;
+    return NULL;
 }
 
-typedef enum {
-    STANDARD_PROCESS,
-    VIEW_LOG_PROCESS,
-    QUIT_PROCESS,
-    TEST_PROCESS,
-} process_t;
+// Only a hello or a datagram gets a new sender a slot. A full table gives up the one heard from longest ago
+udp_peer_t * add_udp_peer(common_t * const restrict common, const struct sockaddr_in * const restrict sockaddr) {
+    udp_peer_t * restrict peer = common->udp_peers;
 
-int main(const int argc, char * const argv[]) {
-    process_t process = STANDARD_PROCESS;
-    uint8_t test_key = 0;
+    for (uint32_t i = 0; i < CONFIG_MAX_UDP_PEERS && peer->address != 0; i++) {
+        udp_peer_t * const restrict udp_peer = common->udp_peers + i;
+
+        if (udp_peer->address == 0 || udp_peer->seen_time < peer->seen_time) {
+            peer = udp_peer;
+        }
+    }
+
+    drop_udp_peer(common, peer);
+    peer->address = sockaddr->sin_addr.s_addr;
+    peer->port = sockaddr->sin_port;
 
+    return peer;
+}
+
+action_code_t read_datagrams(common_t * const restrict common) {
     while (1) {
-        static const struct option options[] = {
-            {
-                .name       = "server",
-                .has_arg    = required_argument,
-                .flag       = NULL,
-                .val        = 's',
-            },
-            {
-                .name       = "log-file",
-                .has_arg    = required_argument,
-                .flag       = NULL,
-                .val        = 'l',
-            },
-            {
-                .name       = "pid-file",
-                .has_arg    = required_argument,
-                .flag       = NULL,
-                .val        = 'p',
-            },
-            {
-                .name       = "quit",
-                .has_arg    = no_argument,
-                .flag       = NULL,
-                .val        = 'q',
-            },
-            {
-                .name       = "view-log",
-                .has_arg    = no_argument,
-                .flag       = NULL,
-                .val        = 'v',
-            },
-            {
-                .name       = "test",
-                .has_arg    = required_argument,
-                .flag       = NULL,
-                .val        = 't',
-            },
-            {
-                .name       = "help",
-                .has_arg    = no_argument,
-                .flag       = NULL,
-                .val        = 'h',
-            },
-            {   NULL, 0, NULL, 0    }
-        };
+        uint8_t buffer[CONFIG_MAX_DATAGRAM];
+        struct sockaddr_in sockaddr;
+        socklen_t sockaddr_size = sizeof(sockaddr);
 
-        const int opt = getopt_long(argc, argv, "s:l:p:qvt:h", options, NULL);
+        const int result = recvfrom(common->udp_fd, buffer, sizeof(buffer), 0,
+            (struct sockaddr *)&sockaddr, &sockaddr_size);
 
-        if (UNLIKELY(opt < 0)) {
-            break;
+        counter_add(&common->telemetry->syscalls, 1);
+
+        if (result < 0) {
+            return SUCCESS_ACTION_CODE;
         }
 
-        switch (opt) {
-            case 's': {
-                char * restrict port = strchr(optarg, ':');
+        const uint64_t recv_time = get_time_ns();
+        counter_add(&common->telemetry->bytes_read, result);
+        expire_udp_peers(common, recv_time);
 
-                if (port != NULL) {
-                    *port++ = '\0';
-                    common.server_port = atoi(port);
-                }
+        udp_peer_t * restrict peer = find_udp_peer(common, &sockaddr);
 
-                common.server_ip = optarg;
+        if (result == sizeof(midi_sync_t) && buffer[0] == MIDI_FRAME_PONG) {
+            if (peer != NULL) {
+                peer->seen_time = recv_time;
+                sync_clock(&peer->sync, (const midi_sync_t *)buffer, recv_time);
+            }
+
+            continue;
+        }
+
+        if (result == sizeof(midi_hello_t) && buffer[0] == MIDI_FRAME_HELLO) {
+            midi_hello_t welcome;
+
+            peer = (peer != NULL ? peer : add_udp_peer(common, &sockaddr));
+            peer->seen_time = recv_time;
+            negotiate(&peer->protocol, (const midi_hello_t *)buffer, &welcome);
+            sendto(common->udp_fd, &welcome, sizeof(welcome), 0, (struct sockaddr *)&sockaddr, sockaddr_size);
+            continue;
+        }
+
+        const midi_datagram_t * const restrict datagram = (const midi_datagram_t *)buffer;
+
+        if (UNLIKELY(result < (int)sizeof(midi_datagram_t) || datagram->frame.type != MIDI_FRAME_DATAGRAM ||
+            result != (int)(sizeof(midi_datagram_t) + (datagram->journal + datagram->count) * sizeof(midi_event_t)))) {
+            continue;
+        }
+
+        const uint32_t session = ntohl(datagram->session);
+        const uint32_t sequence = ntohl(datagram->sequence);
+
+        peer = (peer != NULL ? peer : add_udp_peer(common, &sockaddr));
+        peer->seen_time = recv_time;
+
+        // A restarted client starts a new session, its sequence numbers begin anew and its old notes are let go
+        if (peer->session != session || peer->sequence == 0) {
+            release_udp_peer(common, peer);
+            peer->session = session;
+            peer->sequence = sequence - 1;
+        }
+
+        const int32_t gap = sequence - peer->sequence;
+
+        if (gap <= 0) {
+            common->udp_dropped++;
+            continue;
+        }
+
+        peer->sequence = sequence;
+
+        uint32_t count = 0;
+        uint32_t recovered = 0;
+        midi_event_t midi_events[2 * UINT8_MAX + MIDI_NOTES];
+
+        if (gap == 2) {
+            memcpy(midi_events, datagram->events, datagram->journal * sizeof(midi_event_t));
+            count = recovered = datagram->journal;
+            common->udp_recovered++;
+        }
+
+        memcpy(midi_events + count, datagram->events + datagram->journal, datagram->count * sizeof(midi_event_t));
+        count += datagram->count;
+
+        track_notes(peer->notes, midi_events, count);
+
+        // Past what the journal covers, release whatever the sender no longer holds. A lone loss was recovered
+        if (gap > 1) {
+            common->udp_lost += (gap > 2 ? gap - 1 : 0);
+
+            for (uint32_t i = 0; i < MIDI_NOTES / 8; i++) {
+                uint8_t stale = peer->notes[i] & ~datagram->notes[i];
+                peer->notes[i] &= datagram->notes[i];
+
+                for (; stale != 0; stale &= stale - 1) {
+                    midi_events[count++] = (const midi_event_t) {
+                        .key        = i * 8 + __builtin_ctz(stale),
+                        .velocity   = 0,
+                    };
+                }
+            }
+        }
+
+        const segment_t segment = {
+            .scan_time  = be64toh(datagram->scan_time),
+            .send_time  = be64toh(datagram->send_time),
+            .start      = 0,
+        };
+
+        journal_events(common, CONFIG_MAX_CONNECTIONS + (peer - common->udp_peers), peer->protocol.channel,
+            recv_time, midi_events, count);
+
+        // The lost datagram's scan time never arrived, its recovered events catch up ahead of this one's
+        action_code_t action_code = write_events(common, midi_events, recovered, &peer->protocol,
+            catch_up_time(common, &peer->sync));
+
+        if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+            return action_code;
+        }
+
+        const uint64_t play_time = playout_time(common, &peer->sync, segment.scan_time, recv_time, count - recovered);
+        action_code = write_events(common, midi_events + recovered, count - recovered, &peer->protocol, play_time);
+
+        if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+            return action_code;
+        }
+
+        const uint64_t done_time = get_time_ns();
+        record_latency(common, &peer->sync, &segment, datagram->count, recv_time, done_time);
+
+        midi_sync_t ping;
+
+        if (ping_due(&peer->sync, &ping, done_time)) {
+            sendto(common->udp_fd, &ping, sizeof(ping), 0, (struct sockaddr *)&sockaddr, sockaddr_size);
+        }
+    }
+}
+
+// Splits one read into events and frames, a malformed frame asks for the connection to be closed
+action_code_t decode_connection(common_t * const restrict common, connection_t * const restrict connection,
+                                const uint32_t size) {
+    uint8_t * const restrict buffer = connection->buffer;
+    const uint64_t recv_time = get_time_ns();
+    midi_event_t * const restrict midi_events = common->midi_events;
+
+    uint32_t count = 0;
+    uint32_t offset = 0;
+    uint32_t segment_count = 1;
+    segment_t segments[CONFIG_MAX_READ_SIZE / sizeof(midi_stamp_t) + 1];
+
+    segments[0] = (const segment_t) {
+        .scan_time  = connection->scan_time,
+        .send_time  = connection->send_time,
+        .start      = 0,
+    };
+
+    while (size - offset >= sizeof(midi_event_t)) {
+        if (!(buffer[offset] & MIDI_FRAME_FLAG)) {
+            memcpy(midi_events + count++, buffer + offset, sizeof(midi_event_t));
+            offset += sizeof(midi_event_t);
+            continue;
+        }
+
+        if (size - offset < sizeof(midi_frame_t)) {
+            break;
+        }
+
+        const midi_frame_t * const restrict frame = (const midi_frame_t *)(buffer + offset);
+        const uint32_t frame_size = sizeof(midi_frame_t) + ntohs(frame->size);
+
+        if (UNLIKELY(frame_size > sizeof(connection->buffer))) {
+            return CLOSE_CLIENT_ACTION_CODE;
+        }
+
+        if (size - offset < frame_size) {
+            break;
+        }
+
+        // A batch is a stamp with its events inside, both open a new latency segment
+        if ((frame->type == MIDI_FRAME_BATCH && frame_size >= sizeof(midi_batch_t) &&
+             frame_size % sizeof(midi_event_t) == 0) ||
+            (frame->type == MIDI_FRAME_STAMP && frame_size == sizeof(midi_stamp_t))) {
+            const midi_batch_t * const restrict batch = (const midi_batch_t *)frame;
+            const uint32_t events_size = frame_size - sizeof(midi_batch_t);
+
+            segments[segment_count++] = (const segment_t) {
+                .scan_time  = be64toh(batch->scan_time),
+                .send_time  = be64toh(batch->send_time),
+                .start      = count,
+            };
+
+            memcpy(midi_events + count, batch->events, events_size);
+            count += events_size / sizeof(midi_event_t);
+        } else if (frame->type == MIDI_FRAME_PONG && frame_size == sizeof(midi_sync_t)) {
+            sync_clock(&connection->sync, (const midi_sync_t *)frame, recv_time);
+        } else if (frame->type == MIDI_FRAME_HELLO && frame_size == sizeof(midi_hello_t)) {
+            midi_hello_t welcome;
+            negotiate(&connection->protocol, (const midi_hello_t *)frame, &welcome);
+            write(connection->fd, &welcome, sizeof(welcome));
+        }
+
+        offset += frame_size;
+    }
+
+    // A split frame stays at the front for the next read
+    connection->fill = size - offset;
+    memmove(buffer, buffer + offset, connection->fill);
+
+    if (connection->fill != 0) {
+        counter_add(&common->telemetry->partial_frames, 1);
+    }
+
+    const uint8_t channel = connection->protocol.channel;
+
+    journal_events(common, connection - common->connections, channel, recv_time, midi_events, count);
+    track_notes(connection->notes, midi_events, count);
+
+    // Direct output joins the batch of this wakeup as is, playout stamps every segment with its own time
+    if (common->seq_queue < 0) {
+        const action_code_t action_code = write_events(common, midi_events, count, &connection->protocol, 0);
+
+        if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+            return action_code;
+        }
+    } else {
+        for (uint32_t i = 0; i < segment_count; i++) {
+            const uint32_t start = segments[i].start;
+            const uint32_t end = (i + 1 < segment_count ? segments[i + 1].start : count);
+            const uint64_t play_time = playout_time(common, &connection->sync,
+                segments[i].scan_time, recv_time, end - start);
+            const action_code_t action_code = write_events(common, midi_events + start, end - start,
+                &connection->protocol, play_time);
+
+            if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+                return action_code;
+            }
+        }
+    }
+
+    const uint64_t done_time = get_time_ns();
+
+    for (uint32_t i = 0; i < segment_count; i++) {
+        const uint32_t end = (i + 1 < segment_count ? segments[i + 1].start : count);
+        record_latency(common, &connection->sync, segments + i, end - segments[i].start, recv_time, done_time);
+    }
+
+    connection->scan_time = segments[segment_count - 1].scan_time;
+    connection->send_time = segments[segment_count - 1].send_time;
+
+    return SUCCESS_ACTION_CODE;
+}
+
+connection_t * alloc_connection(common_t * const restrict common, const int fd, const socket_type_t type) {
+    connection_t * const restrict connection = common->free_connections;
+
+    if (UNLIKELY(connection == NULL)) {
+        return NULL;
+    }
+
+    common->free_connections = connection->next;
+    common->connection_count++;
+
+    memset(connection, 0, sizeof(*connection));
+    connection->fd = fd;
+    connection->type = type;
+    connection->protocol.version = MIDI_PROTOCOL_LEGACY;
+
+    return connection;
+}
+
+// Legacy clients never read, newer ones wait for this before they say hello
+static inline void greet_client(const int fd) {
+    const midi_hello_t hello = {
+        .frame.type     = MIDI_FRAME_HELLO,
+        .frame.size     = htons(sizeof(midi_hello_t) - sizeof(midi_frame_t)),
+        .version        = MIDI_PROTOCOL_VERSION,
+        .features       = htons(MIDI_FEATURES),
+    };
+
+    write(fd, &hello, sizeof(hello));
+}
+
+// Closing the fd also drops it from the epoll set. Later events of the same batch may still point at the
+// slot, so it only becomes free again once the batch is done
+void free_connection(common_t * const restrict common, connection_t * const restrict connection) {
+    close(connection->fd);
+    counter_add(&common->telemetry->connections, -1);
+
+    connection->fd = -1;
+    connection->next = common->freed_connections;
+    common->freed_connections = connection;
+    common->connection_count--;
+}
+
+static inline void recycle_connections(common_t * const restrict common) {
+    while (common->freed_connections != NULL) {
+        connection_t * const restrict connection = common->freed_connections;
+
+        common->freed_connections = connection->next;
+        connection->next = common->free_connections;
+        common->free_connections = connection;
+    }
+}
+
+// Edge triggered, so the socket is read until it runs dry
+action_code_t read_connection(common_t * const restrict common, connection_t * const restrict connection) {
+    const int fd = connection->fd;
+
+    while (1) {
+        const uint32_t fill = connection->fill;
+        const int result = read(fd, connection->buffer + fill, sizeof(connection->buffer) - fill);
+        counter_add(&common->telemetry->syscalls, 1);
+
+        if (result < 0 && errno == EINTR) {
+            continue;
+        } else if (result < 0 && errno == EAGAIN) {
+            break;
+        } else if (result <= 0) {
+            free_connection(common, connection);
+            return SUCCESS_ACTION_CODE;
+        }
+
+        counter_add(&common->telemetry->bytes_read, result);
+
+        const action_code_t action_code = decode_connection(common, connection, fill + result);
+
+        if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+            if (action_code == CLOSE_CLIENT_ACTION_CODE) {
+                free_connection(common, connection);
+                return SUCCESS_ACTION_CODE;
+            }
+
+            return action_code;
+        }
+    }
+
+    midi_sync_t ping;
+
+    if (ping_due(&connection->sync, &ping, get_time_ns())) {
+        write(fd, &ping, sizeof(ping));
+    }
+
+    return SUCCESS_ACTION_CODE;
+}
+
+action_code_t accept_clients(common_t * const restrict common, const int server_fd) {
+    while (1) {
+        const int client_fd = accept4(server_fd, NULL, NULL, O_NONBLOCK);
+        counter_add(&common->telemetry->syscalls, 1);
+
+        if (client_fd < 0) {
+            return (errno == EAGAIN || errno == EINTR || errno == ECONNABORTED ?
+                SUCCESS_ACTION_CODE : ACCEPT_CLIENT_ACTION_CODE);
+        }
+
+        connection_t * const restrict connection = alloc_connection(common, client_fd, CLIENT_SOCKET);
+
+        if (UNLIKELY(connection == NULL)) {
+            close(client_fd);
+            continue;
+        }
+
+        counter_add(&common->telemetry->connections, 1);
+        counter_add(&common->telemetry->accepted, 1);
+        greet_client(client_fd);
+
+        struct epoll_event event = {
+            .events     = EPOLLIN | EPOLLET,
+            .data.ptr   = connection,
+        };
+
+        const int result = epoll_ctl(common->epoll_fd, EPOLL_CTL_ADD, client_fd, &event);
+
+        if (UNLIKELY(result < 0)) {
+            return EPOLL_ADD_CLIENT_SOCKET_ACTION_CODE;
+        }
+    }
+}
+
+uint8_t parse_batch(const char * const restrict string, uint32_t * const restrict batch) {
+    long long number;
+
+    if (!parse_number(string, 1, CONFIG_MAX_MIDI_EVENTS, &number)) {
+        return 0;
+    }
+
+    *batch = number;
+    return 1;
+}
+
+// "<device|*> <low>[-<high>] <client:port|subscribers> [channel|-] [transpose]"
+uint8_t parse_route(const char * const restrict string, route_t * const restrict route) {
+    char device[16], range[16], dest[32], channel[8] = "-", transpose[8] = "0", rest;
+    long long number, low, high;
+
+    const int fields = sscanf(string, "%15s %15s %31s %7s %7s %c", device, range, dest, channel, transpose, &rest);
+
+    if (fields < 3 || fields > 5) {
+        return 0;
+    }
+
+    char * const restrict dash = strchr(range, '-');
+
+    if (dash != NULL) {
+        *dash = '\0';
+    }
+
+    if (!parse_number(range, 0, MIDI_NOTES - 1, &low) ||
+        !parse_number(dash != NULL ? dash + 1 : range, low, MIDI_NOTES - 1, &high)) {
+        return 0;
+    }
+
+    *route = (const route_t) {
+        .device     = NO_DEVICE,
+        .low        = low,
+        .high       = high,
+        .channel    = MIDI_CHANNELS,
+        .dest       = { .client = SNDRV_SEQ_ADDRESS_SUBSCRIBERS, .port = SNDRV_SEQ_ADDRESS_UNKNOWN },
+    };
+
+    if (strcmp(device, "*") != 0) {
+        if (!parse_number(device, 0, NO_DEVICE - 1, &number)) {
+            return 0;
+        }
+
+        route->device = number;
+    }
+
+    if (strcmp(channel, "-") != 0) {
+        if (!parse_number(channel, 0, MIDI_CHANNELS - 1, &number)) {
+            return 0;
+        }
+
+        route->channel = number;
+    }
+
+    if (!parse_number(transpose, 1 - MIDI_NOTES, MIDI_NOTES - 1, &number)) {
+        return 0;
+    }
+
+    route->transpose = number;
+
+    if (strcmp(dest, "subscribers") != 0) {
+        parse_seq_addr(dest, &route->dest);
+    }
+
+    return 1;
+}
+
+// * routes add to every row. Without any, a device with no routes of its own plays every note to the
+// subscribers on its own channel, as before routing existed
+action_code_t compile_routes(const common_t * const restrict common, config_t * const restrict config,
+                             const route_t * const restrict routes, const uint32_t route_count) {
+    uint8_t any = 0;
+    uint32_t fill = 0;
+
+    config->route_devices = 0;
+
+    for (uint32_t i = 0; i < route_count; i++) {
+        uint32_t row = 0;
+
+        while (row < config->route_devices && config->devices[row] != routes[i].device) {
+            row++;
+        }
+
+        if (routes[i].device == NO_DEVICE) {
+            any = 1;
+        } else if (row == config->route_devices) {
+            if (UNLIKELY(row == CONFIG_MAX_ROUTE_DEVICES)) {
+                return READ_CONFIG_FILE_ACTION_CODE;
+            }
+
+            config->devices[config->route_devices++] = routes[i].device;
+        }
+    }
+
+    for (uint32_t row = 0; row <= config->route_devices; row++) {
+        const uint8_t fallback = (row == config->route_devices);
+
+        for (uint32_t note = 0; note < MIDI_NOTES; note++) {
+            route_dispatch_t * const restrict entry = &config->dispatch[row][note];
+            entry->first = fill;
+
+            if (fallback && !any) {
+                config->targets[fill++] = (const route_target_t) {
+                    .dest       = common->seq_addr,
+                    .channel    = MIDI_CHANNELS,
+                    .note       = note,
+                };
+            }
+
+            for (uint32_t i = 0; i < route_count && !(fallback && !any); i++) {
+                const route_t * const restrict route = routes + i;
+                const int target = note + route->transpose;
+
+                if ((route->device != NO_DEVICE && (fallback || route->device != config->devices[row])) ||
+                    note < route->low || note > route->high || target < 0 || target >= MIDI_NOTES) {
+                    continue;
+                }
+
+                if (UNLIKELY(fill == CONFIG_MAX_ROUTE_TARGETS)) {
+                    return READ_CONFIG_FILE_ACTION_CODE;
+                }
+
+                config->targets[fill++] = (const route_target_t) {
+                    .dest       = route->dest,
+                    .channel    = route->channel,
+                    .note       = target,
+                };
+            }
+
+            entry->count = fill - entry->first;
+        }
+    }
+
+    return SUCCESS_ACTION_CODE;
+}
+
+// Command line values, overridden by the batch, flush-time and output lines of the -f settings file, plus its routes
+action_code_t load_config(const common_t * const restrict common, config_t * const restrict config) {
+    route_t routes[CONFIG_MAX_ROUTES];
+    uint32_t route_count = 0;
+
+    config->seq_batch = common->seq_batch;
+    config->flush_time = common->flush_time;
+    config->seq_connect = common->seq_connect;
+
+    if (common->config_path != NULL) {
+        FILE * const restrict file = fopen(common->config_path, "r");
+
+        if (UNLIKELY(file == NULL)) {
+            return OPEN_CONFIG_FILE_ACTION_CODE;
+        }
+
+        char line[256];
+        const char * name;
+        const char * value;
+        uint8_t valid = 1;
+
+        while (valid && read_setting(file, line, sizeof(line), &name, &value)) {
+            if (value == NULL) {
+                valid = 0;
+            } else if (strcmp(name, "batch") == 0) {
+                valid = parse_batch(value, &config->seq_batch);
+            } else if (strcmp(name, "flush-time") == 0 && atoi(value) >= 0) {
+                config->flush_time = atoi(value) * 1000ull;
+            } else if (strcmp(name, "output") == 0) {
+                parse_seq_addr(value, &config->seq_connect);
+            } else if (strcmp(name, "route") == 0) {
+                valid = (route_count < CONFIG_MAX_ROUTES && parse_route(value, routes + route_count++));
+            } else {
+                valid = 0;
+            }
+        }
+
+        fclose(file);
+
+        if (UNLIKELY(!valid)) {
+            return READ_CONFIG_FILE_ACTION_CODE;
+        }
+    }
+
+    return compile_routes(common, config, routes, route_count);
+}
+
+// Every note still down is let go where it was sent, the note-off would follow the new routes otherwise
+void release_held(common_t * const restrict common) {
+    for (uint32_t i = 0; i < CONFIG_MAX_CONNECTIONS; i++) {
+        connection_t * const restrict connection = common->connections + i;
+
+        if (connection->type == CLIENT_SOCKET && connection->fd >= 0) {
+            release_notes(common, i, connection->notes, &connection->protocol, &connection->sync);
+        }
+    }
+
+    for (uint32_t i = 0; i < CONFIG_MAX_UDP_PEERS; i++) {
+        release_udp_peer(common, common->udp_peers + i);
+    }
+}
+
+// Built into the slot not in use, a failed reload leaves the running config untouched. Held notes are
+// released and written out while the old routes and subscription still stand
+void reload_config(common_t * const restrict common) {
+    telemetry_t * const restrict telemetry = common->telemetry;
+    config_t * const restrict config = common->configs + (common->config == common->configs);
+
+    action_code_t action_code = load_config(common, config);
+
+    if (action_code == SUCCESS_ACTION_CODE) {
+        release_held(common);
+        action_code = flush_seq(common);
+    }
+
+    if (action_code == SUCCESS_ACTION_CODE) {
+        action_code = connect_seq(common, &common->config->seq_connect, &config->seq_connect);
+    }
+
+    if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+        counter_add(&telemetry->reload_failures, 1);
+        counter_set(&telemetry->reload_error, (uint8_t)action_code);
+        return;
+    }
+
+    common->config = config;
+    counter_add(&telemetry->reloads, 1);
+}
+
+// One message with up to three fds attached
+int send_fds(const int fd, const void * const restrict data, const uint32_t size, const int * const restrict fds,
+             const uint32_t count) {
+    union {
+        struct cmsghdr  header;
+        char            buffer[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+
+    struct iovec iov = {
+        .iov_base   = (void *)data,
+        .iov_len    = size,
+    };
+
+    struct msghdr msg = {
+        .msg_iov        = &iov,
+        .msg_iovlen     = 1,
+        .msg_control    = control.buffer,
+        .msg_controllen = CMSG_SPACE(count * sizeof(int)),
+    };
+
+    struct cmsghdr * const restrict cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+
+    return sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
+
+// The fds are stored after the data, so they may land inside it
+int recv_fds(const int fd, void * const data, const uint32_t size, int * const fds, const uint32_t count) {
+    union {
+        struct cmsghdr  header;
+        char            buffer[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+
+    struct iovec iov = {
+        .iov_base   = data,
+        .iov_len    = size,
+    };
+
+    struct msghdr msg = {
+        .msg_iov        = &iov,
+        .msg_iovlen     = 1,
+        .msg_control    = control.buffer,
+        .msg_controllen = CMSG_SPACE(count * sizeof(int)),
+    };
+
+    const int result = recvmsg(fd, &msg, 0);
+    const struct cmsghdr * const restrict cmsg = CMSG_FIRSTHDR(&msg);
+
+    if (result < 0 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || cmsg == NULL ||
+        cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(count * sizeof(int))) {
+        return -1;
+    }
+
+    memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+
+    return result;
+}
+
+// Gives the sockets, the sequencer client and every client's state to the process started with -u. Nothing
+// is shut down, the sockets carry on in the new process, and until it acks this one can still carry on too
+action_code_t hand_over(common_t * const restrict common) {
+    action_code_t action_code = flush_seq(common);
+
+    if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+        return action_code;
+    }
+
+    handover_t handover = {
+        .version            = HANDOVER_VERSION,
+        .handover_size      = sizeof(handover_t),
+        .connection_size    = sizeof(connection_t),
+        .udp_peer_size      = sizeof(udp_peer_t),
+        .seq_queue          = common->seq_queue,
+        .seq_port           = common->seq_port,
+        .seq_connect        = common->config->seq_connect,
+    };
+
+    memcpy(handover.magic, HANDOVER_MAGIC, sizeof(handover.magic));
+    memcpy(handover.udp_peers, common->udp_peers, sizeof(handover.udp_peers));
+
+    for (uint32_t i = 0; i < CONFIG_MAX_CONNECTIONS; i++) {
+        const connection_t * const restrict connection = common->connections + i;
+        handover.count += (connection->type == CLIENT_SOCKET && connection->fd >= 0 && !connection->closing);
+    }
+
+    const int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+
+    if (UNLIKELY(fd < 0)) {
+        return SEND_HANDOVER_ACTION_CODE;
+    }
+
+    struct sockaddr_un sockaddr = {
+        .sun_family = AF_UNIX,
+    };
+
+    snprintf(sockaddr.sun_path, sizeof(sockaddr.sun_path), "%s", common->handover_path);
+
+    // The new process appends to the journal, so it is left complete before anything goes over
+    const uint8_t journaling = (common->journal_map != NULL);
+    close_journal(common);
+
+    const int fds[] = { common->server_fd, common->udp_fd, common->seq_fd };
+    uint8_t sent = (connect(fd, (struct sockaddr *)&sockaddr, sizeof(sockaddr)) == 0 &&
+        send_fds(fd, &handover, sizeof(handover), fds, 3) == sizeof(handover));
+
+    for (uint32_t i = 0; i < CONFIG_MAX_CONNECTIONS && sent; i++) {
+        const connection_t * const restrict connection = common->connections + i;
+
+        if (connection->type == CLIENT_SOCKET && connection->fd >= 0 && !connection->closing) {
+            sent = (send_fds(fd, connection, sizeof(*connection), &connection->fd, 1) == sizeof(*connection));
+        }
+    }
+
+    const struct timeval timeout = {
+        .tv_sec     = CONFIG_HANDOVER_TIMEOUT / 1000,
+        .tv_usec    = CONFIG_HANDOVER_TIMEOUT % 1000 * 1000,
+    };
+
+    uint8_t ack = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    sent = sent && recv(fd, &ack, sizeof(ack), 0) == sizeof(ack);
+    close(fd);
+
+    if (UNLIKELY(!sent)) {
+        if (journaling) {
+            start_journal(common);
+        }
+
+        return SEND_HANDOVER_ACTION_CODE;
+    }
+
+    return SUCCESS_ACTION_CODE;
+}
+
+static inline void uring_recycle(uring_t * const restrict uring, const uint16_t bid) {
+    struct io_uring_buf * const restrict buf = uring->buf_ring->bufs + (uring->buf_tail & (CONFIG_URING_BUFFERS - 1));
+
+    buf->addr = (uint64_t)(uintptr_t)(uring->buffers + bid * CONFIG_MAX_READ_SIZE);
+    buf->len = CONFIG_MAX_READ_SIZE;
+    buf->bid = bid;
+    uring->buf_tail++;
+}
+
+// Publishes queued sqes and optionally waits for one completion
+int uring_enter(common_t * const restrict common, const uint32_t wait) {
+    uring_t * const restrict uring = &common->uring;
+    const uint32_t to_submit = uring->sq_tail - uring->sq_submitted;
+
+    __atomic_store_n(uring->sq_ktail, uring->sq_tail, __ATOMIC_RELEASE);
+
+    const int result = syscall(__NR_io_uring_enter, uring->fd, to_submit, wait,
+        (wait != 0 ? IORING_ENTER_GETEVENTS : 0), NULL, 0);
+
+    counter_add(&common->telemetry->syscalls, 1);
+
+    if (result > 0) {
+        uring->sq_submitted += result;
+    }
+
+    return result;
+}
+
+// A connection never has more than one request queued or armed, and the ring has an sqe for every
+// connection plus a cancel, so it can't fill up with sqes the kernel has not taken yet
+struct io_uring_sqe * uring_sqe(common_t * const restrict common, connection_t * const restrict connection,
+                                const uint8_t opcode) {
+    uring_t * const restrict uring = &common->uring;
+    struct io_uring_sqe * const restrict sqe = uring->sqes + (uring->sq_tail & uring->sq_mask);
+    uring->sq_tail++;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = (connection != NULL ? connection->fd : -1);
+    sqe->user_data = (uint64_t)(uintptr_t)connection;
+
+    return sqe;
+}
+
+// Every connection keeps one multishot request armed, re-armed whenever the kernel ends it
+void uring_arm(common_t * const restrict common, connection_t * const restrict connection) {
+    switch (connection->type) {
+        case SERVER_SOCKET: {
+            struct io_uring_sqe * const restrict sqe = uring_sqe(common, connection, IORING_OP_ACCEPT);
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_NONBLOCK;
+        } break;
+        case UDP_SOCKET: {
+            struct io_uring_sqe * const restrict sqe = uring_sqe(common, connection, IORING_OP_POLL_ADD);
+            sqe->poll32_events = POLLIN;
+            sqe->len = IORING_POLL_ADD_MULTI;
+        } break;
+        case CLIENT_SOCKET: {
+            struct io_uring_sqe * const restrict sqe = uring_sqe(common, connection, IORING_OP_RECV);
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = 0;
+        } break;
+    }
+
+    common->uring.armed++;
+}
+
+// Listening and UDP sockets, plus the clients an upgrade brought along
+void uring_arm_all(common_t * const restrict common) {
+    uring_arm(common, common->listen_connection);
+    uring_arm(common, common->udp_connection);
+
+    for (uint32_t i = 0; i < CONFIG_MAX_CONNECTIONS; i++) {
+        connection_t * const restrict connection = common->connections + i;
+
+        if (connection->type == CLIENT_SOCKET && connection->fd >= 0 && !connection->closing) {
+            uring_arm(common, connection);
+        }
+    }
+}
+
+action_code_t main_loop(common_t * const restrict common) {
+    while (1) {
+        if (UNLIKELY(stats_requested)) {
+            stats_requested = 0;
+            write_stats(common);
+        }
+
+        if (UNLIKELY(stats_reset)) {
+            stats_reset = 0;
+            reset_stats(common);
+        }
+
+        if (UNLIKELY(reload_requested)) {
+            reload_requested = 0;
+            reload_config(common);
+        }
+
+        if (UNLIKELY(handover_requested)) {
+            handover_requested = 0;
+
+            if (hand_over(common) == SUCCESS_ACTION_CODE) {
+                return HANDOVER_ACTION_CODE;
+            }
+        }
+
+        struct epoll_event events[CONFIG_MAX_EPOLL_EVENTS];
+        const int N = epoll_wait(common->epoll_fd, events, CONFIG_MAX_EPOLL_EVENTS, -1);
+        counter_add(&common->telemetry->syscalls, 1);
+
+        if (UNLIKELY(N < 0)) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return EPOLL_WAIT_ACTION_CODE;
+        }
+
+        for (int i = 0; i < N; i++) {
+            const uint32_t epoll_events = events[i].events;
+            connection_t * const restrict connection = events[i].data.ptr;
+            action_code_t action_code = SUCCESS_ACTION_CODE;
+
+            switch (connection->type) {
+                case UDP_SOCKET: action_code = read_datagrams(common); break;
+                case SERVER_SOCKET: action_code = accept_clients(common, connection->fd); break;
+                case CLIENT_SOCKET: {
+                    if (connection->fd < 0) {
+                        break; // freed by an earlier event of this batch
+                    } else if (epoll_events & EPOLLIN) {
+                        action_code = read_connection(common, connection);
+                    } else {
+                        free_connection(common, connection);
+                    }
+                } break;
+            }
+
+            if (action_code == SUCCESS_ACTION_CODE) {
+                action_code = flush_due(common);
+            }
+
+            if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+                return action_code;
+            }
+        }
+
+        recycle_connections(common);
+
+        const action_code_t action_code = flush_seq(common);
+        prepare_journal(common);
+
+        if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+            return action_code;
+        }
+    }
+}
+
+// A shut down socket ends its multishot recv, the connection is freed on that last completion
+void uring_close(connection_t * const restrict connection) {
+    connection->closing = 1;
+    shutdown(connection->fd, SHUT_RDWR);
+}
+
+action_code_t uring_receive(common_t * const restrict common, connection_t * const restrict connection,
+                            const uint8_t * restrict data, uint32_t size) {
+    counter_add(&common->telemetry->bytes_read, size);
+
+    while (size > 0 && !connection->closing) {
+        const uint32_t fill = connection->fill;
+        const uint32_t room = sizeof(connection->buffer) - fill;
+        const uint32_t chunk = (size < room ? size : room);
+
+        memcpy(connection->buffer + fill, data, chunk);
+        data += chunk;
+        size -= chunk;
+
+        const action_code_t action_code = decode_connection(common, connection, fill + chunk);
+
+        if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+            if (action_code == CLOSE_CLIENT_ACTION_CODE) {
+                uring_close(connection);
+                break;
+            }
+
+            return action_code;
+        }
+    }
+
+    midi_sync_t ping;
+
+    if (!connection->closing && ping_due(&connection->sync, &ping, get_time_ns())) {
+        write(connection->fd, &ping, sizeof(ping));
+    }
+
+    return SUCCESS_ACTION_CODE;
+}
+
+action_code_t uring_complete(common_t * const restrict common, const struct io_uring_cqe * const restrict cqe) {
+    connection_t * const restrict connection = (connection_t *)(uintptr_t)cqe->user_data;
+    const uint8_t more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    const int result = cqe->res;
+    action_code_t action_code = SUCCESS_ACTION_CODE;
+
+    common->uring.armed -= !more;
+
+    switch (connection->type) {
+        case UDP_SOCKET: action_code = read_datagrams(common); break;
+        case SERVER_SOCKET: {
+            if (result < 0) {
+                break;
+            }
+
+            connection_t * const restrict client = alloc_connection(common, result, CLIENT_SOCKET);
+
+            if (UNLIKELY(client == NULL)) {
+                close(result);
+                break;
+            }
+
+            counter_add(&common->telemetry->connections, 1);
+            counter_add(&common->telemetry->accepted, 1);
+            greet_client(result);
+            uring_arm(common, client);
+        } break;
+        case CLIENT_SOCKET: {
+            if (cqe->flags & IORING_CQE_F_BUFFER) {
+                const uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+                if (result > 0 && !connection->closing) {
+                    action_code = uring_receive(common, connection, common->uring.buffers + bid * CONFIG_MAX_READ_SIZE,
+                        result);
+                }
+
+                uring_recycle(&common->uring, bid);
+            }
+
+            if (!more && (connection->closing || (result <= 0 && result != -ENOBUFS && result != -ECANCELED))) {
+                free_connection(common, connection);
+                return action_code;
+            }
+        } break;
+    }
+
+    if (!more && !common->uring.draining) {
+        uring_arm(common, connection);
+    }
+
+    return action_code;
+}
+
+// Cancel completions carry no connection
+action_code_t uring_reap(common_t * const restrict common) {
+    uring_t * const restrict uring = &common->uring;
+    action_code_t action_code = SUCCESS_ACTION_CODE;
+
+    uint32_t head = *uring->cq_head;
+    const uint32_t tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail && action_code == SUCCESS_ACTION_CODE; head++) {
+        const struct io_uring_cqe * const restrict cqe = uring->cqes + (head & uring->cq_mask);
+
+        if (cqe->user_data != 0) {
+            action_code = uring_complete(common, cqe);
+        }
+
+        if (action_code == SUCCESS_ACTION_CODE) {
+            action_code = flush_due(common);
+        }
+    }
+
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+    __atomic_store_n(&uring->buf_ring->tail, uring->buf_tail, __ATOMIC_RELEASE);
+
+    return action_code;
+}
+
+// Cancels every armed request before a handover and takes in what they still bring, without the shutdown
+// of uring_close the sockets stay usable for the next process
+action_code_t uring_drain(common_t * const restrict common) {
+    uring_t * const restrict uring = &common->uring;
+    struct io_uring_sqe * const restrict sqe = uring_sqe(common, NULL, IORING_OP_ASYNC_CANCEL);
+
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+    uring->draining = 1;
+
+    while (uring->armed != 0) {
+        if (UNLIKELY(uring_enter(common, 1) < 0 && errno != EINTR && errno != EBUSY)) {
+            return URING_ENTER_ACTION_CODE;
+        }
+
+        const action_code_t action_code = uring_reap(common);
+
+        if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+            return action_code;
+        }
+    }
+
+    uring->draining = 0;
+
+    return SUCCESS_ACTION_CODE;
+}
+
+// Completions are handled a ring at a time, the sequencer writes of a whole batch go out in one syscall
+action_code_t uring_loop(common_t * const restrict common) {
+    uring_arm_all(common);
+
+    while (1) {
+        if (UNLIKELY(stats_requested)) {
+            stats_requested = 0;
+            write_stats(common);
+        }
+
+        if (UNLIKELY(stats_reset)) {
+            stats_reset = 0;
+            reset_stats(common);
+        }
+
+        if (UNLIKELY(reload_requested)) {
+            reload_requested = 0;
+            reload_config(common);
+        }
+
+        if (UNLIKELY(handover_requested)) {
+            handover_requested = 0;
+
+            const action_code_t action_code = uring_drain(common);
+
+            if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+                return action_code;
+            } else if (hand_over(common) == SUCCESS_ACTION_CODE) {
+                return HANDOVER_ACTION_CODE;
+            }
+
+            uring_arm_all(common);
+        }
+
+        const int result = uring_enter(common, 1);
+
+        if (UNLIKELY(result < 0)) {
+            if (errno == EINTR || errno == EBUSY) {
+                continue;
+            }
+
+            return URING_ENTER_ACTION_CODE;
+        }
+
+        action_code_t action_code = uring_reap(common);
+        recycle_connections(common);
+
+        if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+            return action_code;
+        }
+
+        action_code = flush_seq(common);
+        prepare_journal(common);
+
+        if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+            return action_code;
+        }
+    }
+}
+
+// Setup and provided buffer rings came in 5.19, multishot recv only in 6.0: before that every recv completes
+// with -EINVAL and would drop its client. One recv on a socketpair tells, it is ended and reaped right here
+action_code_t probe_uring(common_t * const restrict common) {
+    uring_t * const restrict uring = &common->uring;
+    int fds[2];
+
+    if (UNLIKELY(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) < 0)) {
+        return SETUP_URING_ACTION_CODE;
+    }
+
+    struct io_uring_sqe * const restrict sqe = uring_sqe(common, NULL, IORING_OP_RECV);
+    sqe->fd = fds[0];
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+
+    const uint8_t byte = 0;
+    uint8_t multishot = 0;
+    uint8_t done = (write(fds[1], &byte, sizeof(byte)) != sizeof(byte));
+
+    while (!done && (uring_enter(common, 1) >= 0 || errno == EINTR)) {
+        uint32_t head = *uring->cq_head;
+        const uint32_t tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; head++) {
+            const struct io_uring_cqe * const restrict cqe = uring->cqes + (head & uring->cq_mask);
+
+            if (cqe->flags & IORING_CQE_F_BUFFER) {
+                uring_recycle(uring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+
+            // Still armed after the byte, the shutdown ends it with one last completion
+            if (cqe->flags & IORING_CQE_F_MORE) {
+                multishot = (cqe->res > 0);
+                shutdown(fds[0], SHUT_RDWR);
+            } else {
+                done = 1;
+            }
+        }
+
+        __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+        __atomic_store_n(&uring->buf_ring->tail, uring->buf_tail, __ATOMIC_RELEASE);
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+
+    return (multishot && done ? SUCCESS_ACTION_CODE : SETUP_URING_ACTION_CODE);
+}
+
+action_code_t init_uring(common_t * const restrict common) {
+    uring_t * const restrict uring = &common->uring;
+    struct io_uring_params params = { 0 };
+
+    const int fd = syscall(__NR_io_uring_setup, CONFIG_URING_ENTRIES, &params);
+
+    if (UNLIKELY(fd < 0)) {
+        return SETUP_URING_ACTION_CODE;
+    } else {
+        uring->fd = fd;
+    }
+
+    if (UNLIKELY((params.features & IORING_FEAT_SINGLE_MMAP) == 0)) {
+        return SETUP_URING_ACTION_CODE;
+    }
+
+    const uint32_t sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    const uint32_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    const uint32_t ring_size = (sq_size > cq_size ? sq_size : cq_size);
+
+    uint8_t * const ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        fd, IORING_OFF_SQ_RING);
+
+    if (UNLIKELY(ring == MAP_FAILED)) {
+        return SETUP_URING_ACTION_CODE;
+    }
+
+    uring->ring_map = ring;
+    uring->ring_size = ring_size;
+
+    struct io_uring_sqe * const sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+    if (UNLIKELY(sqes == MAP_FAILED)) {
+        return SETUP_URING_ACTION_CODE;
+    }
+
+    uring->sqes = sqes;
+    uring->sq_entries = params.sq_entries;
+    uring->sq_mask = *(uint32_t *)(ring + params.sq_off.ring_mask);
+    uring->cq_mask = *(uint32_t *)(ring + params.cq_off.ring_mask);
+    uring->sq_head = (uint32_t *)(ring + params.sq_off.head);
+    uring->sq_ktail = (uint32_t *)(ring + params.sq_off.tail);
+    uring->cq_head = (uint32_t *)(ring + params.cq_off.head);
+    uring->cq_tail = (uint32_t *)(ring + params.cq_off.tail);
+    uring->cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+    uring->sq_tail = *uring->sq_ktail;
+    uring->sq_submitted = uring->sq_tail;
+
+    if (UNLIKELY(uring->sq_entries < CONFIG_MAX_CONNECTIONS + 1)) {
+        return SETUP_URING_ACTION_CODE;
+    }
+
+    // Slots map one to one onto sqes, so the indirection array is filled once
+    uint32_t * const array = (uint32_t *)(ring + params.sq_off.array);
+
+    for (uint32_t i = 0; i < params.sq_entries; i++) {
+        array[i] = i;
+    }
+
+    const uint32_t buf_ring_size = CONFIG_URING_BUFFERS * sizeof(struct io_uring_buf);
+    const uint32_t buffers_size = CONFIG_URING_BUFFERS * CONFIG_MAX_READ_SIZE;
+
+    uint8_t * const buffers = mmap(NULL, buf_ring_size + buffers_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+
+    if (UNLIKELY(buffers == MAP_FAILED)) {
+        return SETUP_URING_ACTION_CODE;
+    }
+
+    uring->buf_ring = (struct io_uring_buf_ring *)buffers;
+    uring->buffers = buffers + buf_ring_size;
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr      = (uint64_t)(uintptr_t)uring->buf_ring,
+        .ring_entries   = CONFIG_URING_BUFFERS,
+        .bgid           = 0,
+    };
+
+    if (UNLIKELY(syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)) {
+        return SETUP_URING_ACTION_CODE;
+    }
+
+    for (uint16_t bid = 0; bid < CONFIG_URING_BUFFERS; bid++) {
+        uring_recycle(uring, bid);
+    }
+
+    __atomic_store_n(&uring->buf_ring->tail, uring->buf_tail, __ATOMIC_RELEASE);
+
+    return probe_uring(common);
+}
+
+void close_uring(common_t * const restrict common) {
+    uring_t * const restrict uring = &common->uring;
+
+    if (uring->fd >= 0) {
+        close(uring->fd);
+        uring->fd = -1;
+    }
+}
+
+// Registers the server as its own sequencer client with one output port, events go to whoever subscribes
+// to it rather than through Midi Through. A client handed over keeps its port and subscribers
+action_code_t open_seq(common_t * const restrict common) {
+    if (common->seq_fd >= 0) {
+        return connect_seq(common, &common->seq_connected, &common->config->seq_connect);
+    }
+
+    const int seq_fd = open(common->seq_path, O_WRONLY);
+
+    if (UNLIKELY(seq_fd < 0)) {
+        return OPEN_SND_SEQ_ACTION_CODE;
+    } else {
+        common->seq_fd = seq_fd;
+    }
+
+    const action_code_t action_code = register_seq(common);
+
+    if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+        return action_code;
+    }
+
+    return connect_seq(common, NULL, &common->config->seq_connect);
+}
+
+action_code_t start_queue(common_t * const restrict common) {
+    struct snd_seq_queue_info queue_info = {
+        .name   = APP_NAME,
+    };
+
+    if (UNLIKELY(ioctl(common->seq_fd, SNDRV_SEQ_IOCTL_CREATE_QUEUE, &queue_info) < 0)) {
+        return CREATE_SEQ_QUEUE_ACTION_CODE;
+    } else {
+        common->seq_queue = queue_info.queue;
+    }
+
+    const struct snd_seq_event start = {
+        .type                   = SNDRV_SEQ_EVENT_START,
+        .flags                  = SNDRV_SEQ_EVENT_LENGTH_FIXED,
+        .queue                  = SNDRV_SEQ_QUEUE_DIRECT,
+        .dest.client            = SNDRV_SEQ_CLIENT_SYSTEM,
+        .dest.port              = SNDRV_SEQ_PORT_SYSTEM_TIMER,
+        .data.queue.queue       = queue_info.queue,
+    };
+
+    if (UNLIKELY(write(common->seq_fd, &start, sizeof(start)) != sizeof(start))) {
+        return START_SEQ_QUEUE_ACTION_CODE;
+    }
+
+    return SUCCESS_ACTION_CODE;
+}
+
+// A queue handed over is already running
+action_code_t init_queue(common_t * const restrict common) {
+    if (common->seq_queue < 0) {
+        const action_code_t action_code = start_queue(common);
+
+        if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+            return action_code;
+        }
+    }
+
+    common->playout_delay = common->playout_min;
+    common->playout_window = get_time_ns();
+    sync_queue(common);
+
+    return SUCCESS_ACTION_CODE;
+}
+
+// Sockets inherited from a service manager or handed over by the previous process are used as they are
+action_code_t open_sockets(common_t * const restrict common) {
+    struct sockaddr_in sockaddr = {
+        .sin_family         = AF_INET,
+        .sin_port           = htons(common->server_port),
+        .sin_addr.s_addr    = htonl(INADDR_ANY),
+    };
+
+    const char * const server_ip = common->server_ip;
+
+    if (server_ip != NULL) {
+        inet_pton(AF_INET, server_ip, &sockaddr.sin_addr);
+    }
+
+    if (common->server_fd < 0) {
+        const int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+
+        if (UNLIKELY(server_fd < 0)) {
+            return CREATE_SERVER_SOCKET_ACTION_CODE;
+        } else {
+            common->server_fd = server_fd;
+        }
+
+        // Clients reconnect as soon as a restarted server listens again, its old connections may still be in TIME_WAIT
+        const int reuse = 1;
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        if (UNLIKELY(bind(server_fd, (struct sockaddr *)&sockaddr, sizeof(sockaddr)) < 0)) {
+            return BIND_SERVER_SOCKET_ACTION_CODE;
+        }
+
+        if (UNLIKELY(listen(server_fd, SOMAXCONN) < 0)) {
+            return LISTEN_SERVER_SOCKET_ACTION_CODE;
+        }
+    }
+
+    // Accepted clients inherit it, the greeting, welcome and pings are small writes that must not wait for an ACK
+    const int nodelay = 1;
+    setsockopt(common->server_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    if (common->udp_fd < 0) {
+        const int udp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+
+        if (UNLIKELY(udp_fd < 0)) {
+            return CREATE_UDP_SOCKET_ACTION_CODE;
+        } else {
+            common->udp_fd = udp_fd;
+        }
+
+        if (UNLIKELY(bind(udp_fd, (struct sockaddr *)&sockaddr, sizeof(sockaddr)) < 0)) {
+            return BIND_UDP_SOCKET_ACTION_CODE;
+        }
+    }
+
+    return SUCCESS_ACTION_CODE;
+}
+
+// A new segment rather than the old one cut short, a process handing over may still be counting in it.
+// What was counted in the fallback until now carries over
+void open_telemetry(common_t * const restrict common) {
+    unlink(common->telemetry_path);
+
+    telemetry_t * const restrict telemetry = map_telemetry(common->telemetry_path, sizeof(telemetry_t), 1);
+
+    if (telemetry == NULL) {
+        return;
+    }
+
+    *telemetry = *common->telemetry;
+    telemetry->header = (const telemetry_header_t) {
+        .magic      = TELEMETRY_MAGIC,
+        .size       = sizeof(telemetry_t),
+        .pid        = getpid(),
+        .start_time = get_time_ns(),
+    };
+    telemetry->handover = HANDOVER_VERSION;
+
+    common->telemetry = telemetry;
+}
+
+// Sent once the server taking over is ready to serve, the old one quits on this byte. Only then do the pid
+// file and the telemetry become this process's, any failure before leaves the old one serving
+action_code_t ack_handover(common_t * const restrict common) {
+    const uint8_t ack = 1;
+
+    if (common->handover_fd < 0) {
+        return SUCCESS_ACTION_CODE;
+    }
+
+    if (UNLIKELY(write(common->handover_fd, &ack, sizeof(ack)) != sizeof(ack))) {
+        return RECEIVE_HANDOVER_ACTION_CODE;
+    }
+
+    close(common->handover_fd);
+    common->handover_fd = -1;
+    open_telemetry(common);
+
+    return write_pid(common, getpid());
+}
+
+action_code_t init_daemon(common_t * const restrict common) {
+    if (common->handover_fd < 0) {
+        open_telemetry(common);
+    }
+
+    action_code_t action_code = open_sockets(common);
+
+    if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+        return action_code;
+    }
+
+    const int epoll_fd = epoll_create(1);
+
+    if (UNLIKELY(epoll_fd < 0)) {
+        return EPOLL_CREATE_ACTION_CODE;
+    } else {
+        common->epoll_fd = epoll_fd;
+    }
+
+    // Connections taken over from the previous process sit at the front of the slab
+    for (int i = CONFIG_MAX_CONNECTIONS - 1; i >= (int)common->connection_count; i--) {
+        common->connections[i].fd = -1;
+        common->connections[i].next = common->free_connections;
+        common->free_connections = common->connections + i;
+    }
+
+    struct epoll_event event = {
+        .events     = EPOLLIN | EPOLLET,
+    };
+
+    for (uint32_t i = 0; i < common->connection_count; i++) {
+        event.data.ptr = common->connections + i;
+
+        if (UNLIKELY(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, common->connections[i].fd, &event) < 0)) {
+            return EPOLL_ADD_CLIENT_SOCKET_ACTION_CODE;
+        }
+
+        counter_add(&common->telemetry->connections, 1);
+    }
+
+    common->listen_connection = alloc_connection(common, common->server_fd, SERVER_SOCKET);
+    event.events = EPOLLIN;
+    event.data.ptr = common->listen_connection;
+
+    int result = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, common->server_fd, &event);
+
+    if (UNLIKELY(result < 0)) {
+        return EPOLL_ADD_SERVER_SOCKET_ACTION_CODE;
+    }
+
+    common->udp_connection = alloc_connection(common, common->udp_fd, UDP_SOCKET);
+    event.data.ptr = common->udp_connection;
+    result = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, common->udp_fd, &event);
+
+    if (UNLIKELY(result < 0)) {
+        return EPOLL_ADD_UDP_SOCKET_ACTION_CODE;
+    }
+
+    action_code = load_config(common, common->configs);
+
+    if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+        return action_code;
+    } else {
+        common->config = common->configs;
+    }
+
+    action_code = open_seq(common);
+
+    if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+        return action_code;
+    }
+
+    for (int i = 0; i < CONFIG_MAX_MIDI_EVENTS; i++) {
+        common->seq_events[i] = (const struct snd_seq_event) {
+            .flags              = SNDRV_SEQ_EVENT_LENGTH_FIXED,
+            .queue              = SNDRV_SEQ_QUEUE_DIRECT,
+            .source             = common->seq_port,
+            .data.note.channel  = 0,
+        };
+    }
+
+    if (common->playout_min != 0) {
+        const action_code_t action_code = init_queue(common);
+
+        if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+            return action_code;
+        }
+    } else {
+        common->seq_queue = -1; // a queue handed over stays idle
+    }
+
+    if (common->journal_path != NULL) {
+        const action_code_t action_code = start_journal(common);
+
+        if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+            return action_code;
+        }
+    }
+
+    // Kernels without multishot recv or provided buffer rings keep the epoll loop
+    const uint8_t use_uring = (common->use_uring && init_uring(common) == SUCCESS_ACTION_CODE);
+
+    if (!use_uring) {
+        close_uring(common);
+    }
+
+    action_code = ack_handover(common);
+
+    if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+        return action_code;
+    }
+
+    return (use_uring ? uring_loop(common) : main_loop(common));
+}
+
+// After a handover the pid file and the telemetry already belong to the new process, and before an upgrade
+// acks they still belong to the old one. Closing the handover socket tells the old one to carry on
+uint8_t close_daemon(common_t * const restrict common, const action_code_t action_code) {
+    const uint8_t owned = (action_code != HANDOVER_ACTION_CODE && common->handover_fd < 0);
+
+    if (common->handover_fd >= 0) {
+        close(common->handover_fd);
+    }
+
+    close_journal(common);
+
+    if (common->seq_fd >= 0) {
+        close(common->seq_fd);
+    }
+
+    if (common->udp_fd >= 0) {
+        close(common->udp_fd);
+    }
+
+    if (common->epoll_fd >= 0) {
+        close(common->epoll_fd);
+    }
+
+    close_uring(common);
+    return owned;
+}
+
+void daemon_signal(const int code) {
+    switch (code) {
+        case SIGUSR2: stats_reset = 1; return;
+        case SIGQUIT: handover_requested = 1; return;
+    }
+}
+
+// Sockets passed by a service manager, systemd style: LISTEN_FDS of them from fd 3, meant for LISTEN_PID
+void inherit_sockets(common_t * const restrict common) {
+    const char * const listen_pid = getenv("LISTEN_PID");
+    const char * const listen_fds = getenv("LISTEN_FDS");
+
+    if (listen_pid == NULL || listen_fds == NULL || atoi(listen_pid) != getpid()) {
+        return;
+    }
+
+    for (int fd = 3; fd < 3 + atoi(listen_fds); fd++) {
+        int type = 0;
+        socklen_t size = sizeof(type);
+
+        if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &size) < 0) {
+            continue;
+        }
+
+        if (type == SOCK_STREAM && common->server_fd < 0) {
+            common->server_fd = fd;
+        } else if (type == SOCK_DGRAM && common->udp_fd < 0) {
+            common->udp_fd = fd;
+        } else {
+            continue;
+        }
+
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+}
+
+// Closes whatever a failed handover already brought in, the old process still serves with its own copies
+void drop_handover(common_t * const restrict common) {
+    int * const fds[] = { &common->server_fd, &common->udp_fd, &common->seq_fd };
+
+    for (uint32_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if (*fds[i] >= 0) {
+            close(*fds[i]);
+            *fds[i] = -1;
+        }
+    }
+
+    for (uint32_t i = 0; i < common->connection_count; i++) {
+        close(common->connections[i].fd);
+    }
+
+    common->connection_count = 0;
+}
+
+// Each client lands in the slab slot it will keep, its fd is stored over the old process's number
+action_code_t receive_handover(common_t * const restrict common, const int fd) {
+    handover_t handover;
+    int fds[] = { -1, -1, -1 };
+
+    const struct timeval timeout = {
+        .tv_sec     = CONFIG_HANDOVER_TIMEOUT / 1000,
+        .tv_usec    = CONFIG_HANDOVER_TIMEOUT % 1000 * 1000,
+    };
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    const int result = recv_fds(fd, &handover, sizeof(handover), fds, 3);
+
+    common->server_fd = fds[0];
+    common->udp_fd = fds[1];
+    common->seq_fd = fds[2];
+
+    if (UNLIKELY(result != sizeof(handover) ||
+                 memcmp(handover.magic, HANDOVER_MAGIC, sizeof(handover.magic)) != 0 ||
+                 handover.version != HANDOVER_VERSION || handover.handover_size != sizeof(handover_t) ||
+                 handover.connection_size != sizeof(connection_t) || handover.udp_peer_size != sizeof(udp_peer_t) ||
+                 handover.count > CONFIG_MAX_CONNECTIONS - 2)) {
+        drop_handover(common);
+        return RECEIVE_HANDOVER_ACTION_CODE;
+    }
+
+    common->seq_queue = handover.seq_queue;
+    common->seq_port = handover.seq_port;
+    common->seq_connected = handover.seq_connect;
+    memcpy(common->udp_peers, handover.udp_peers, sizeof(common->udp_peers));
+
+    for (uint32_t i = 0; i < handover.count; i++) {
+        connection_t * const restrict connection = common->connections + i;
+
+        if (UNLIKELY(recv_fds(fd, connection, sizeof(*connection), &connection->fd, 1) != sizeof(*connection))) {
+            drop_handover(common);
+            return RECEIVE_HANDOVER_ACTION_CODE;
+        }
+
+        connection->next = NULL;
+        common->connection_count = i + 1;
+    }
+
+    return SUCCESS_ACTION_CODE;
+}
+
+// Asks the daemon named in the pid file for everything it serves with, clients only see a short pause. Its
+// telemetry has to name the same pid and the same handover version, nothing else gets the SIGQUIT. The
+// socket stays open for the ack, sent once the new server is ready
+action_code_t take_over(common_t * const restrict common) {
+    pid_t pid;
+    action_code_t action_code = read_pid(common, &pid);
+
+    if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+        return action_code;
+    }
+
+    const telemetry_t * const restrict telemetry = map_telemetry(common->telemetry_path, sizeof(telemetry_t), 0);
+    const uint8_t speaks = (telemetry != NULL && telemetry->header.pid == (uint64_t)pid &&
+        telemetry->handover == HANDOVER_VERSION);
+
+    if (telemetry != NULL) {
+        munmap((void *)telemetry, sizeof(telemetry_t));
+    }
+
+    if (UNLIKELY(!speaks)) {
+        return HANDOVER_VERSION_ACTION_CODE;
+    }
+
+    const int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+
+    if (UNLIKELY(listen_fd < 0)) {
+        return OPEN_HANDOVER_SOCKET_ACTION_CODE;
+    }
+
+    struct sockaddr_un sockaddr = {
+        .sun_family = AF_UNIX,
+    };
+
+    snprintf(sockaddr.sun_path, sizeof(sockaddr.sun_path), "%s", common->handover_path);
+    unlink(common->handover_path);
+
+    if (UNLIKELY(bind(listen_fd, (struct sockaddr *)&sockaddr, sizeof(sockaddr)) < 0 || listen(listen_fd, 1) < 0)) {
+        close(listen_fd);
+        return OPEN_HANDOVER_SOCKET_ACTION_CODE;
+    }
+
+    struct pollfd pollfd = {
+        .fd         = listen_fd,
+        .events     = POLLIN,
+    };
+
+    const int fd = (kill(pid, SIGQUIT) == 0 && poll(&pollfd, 1, CONFIG_HANDOVER_TIMEOUT) > 0 ?
+        accept(listen_fd, NULL, NULL) : -1);
+
+    close(listen_fd);
+    unlink(common->handover_path);
+
+    if (UNLIKELY(fd < 0)) {
+        return RECEIVE_HANDOVER_ACTION_CODE;
+    }
+
+    action_code = receive_handover(common, fd);
+
+    if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+        close(fd);
+        return action_code;
+    }
+
+    common->handover_fd = fd;
+
+    return SUCCESS_ACTION_CODE;
+}
+
+// Taking over, the child writes its own pid once the old server has let go
+action_code_t started_daemon(common_t * const restrict common, const pid_t pid) {
+    if (common->handover_fd >= 0) {
+        close(common->handover_fd);
+        return SUCCESS_ACTION_CODE;
+    }
+
+    return write_pid(common, pid);
+}
+
+action_code_t upgrade(common_t * const restrict common) {
+    const action_code_t action_code = take_over(common);
+
+    if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+        return action_code;
+    }
+
+    inherit_sockets(common);
+    return init(common);
+}
+
+typedef struct {
+    int         fd;
+    uint32_t    fill;
+    uint8_t     buffer[64];
+} bench_connection_t;
+
+// Pongs let the server put the bench's send times on its own clock
+void bench_pong(bench_connection_t * const restrict connection) {
+    const int result = recv(connection->fd, connection->buffer + connection->fill,
+        sizeof(connection->buffer) - connection->fill, MSG_DONTWAIT);
+
+    if (result <= 0) {
+        return;
+    }
+
+    const uint32_t size = connection->fill + result;
+    uint32_t offset = 0;
+
+    while (size - offset >= sizeof(midi_frame_t)) {
+        const midi_frame_t * const restrict frame = (const midi_frame_t *)(connection->buffer + offset);
+        const uint32_t frame_size = sizeof(midi_frame_t) + ntohs(frame->size);
+
+        if (frame_size > sizeof(connection->buffer) || size - offset < frame_size) {
+            break;
+        }
+
+        if (frame->type == MIDI_FRAME_PING && frame_size == sizeof(midi_sync_t)) {
+            midi_sync_t pong = *(const midi_sync_t *)frame;
+
+            pong.frame.type = MIDI_FRAME_PONG;
+            pong.client_time = htobe64(get_time_ns());
+            write(connection->fd, &pong, sizeof(pong));
+        }
+
+        offset += frame_size;
+    }
+
+    connection->fill = (size - offset < sizeof(connection->buffer) ? size - offset : 0);
+    memmove(connection->buffer, connection->buffer + offset, connection->fill);
+}
+
+action_code_t bench_open(const common_t * const restrict common, bench_connection_t * const restrict connection,
+                         struct pollfd * const restrict pollfd, const uint8_t channel) {
+    struct sockaddr_in sockaddr = {
+        .sin_family         = AF_INET,
+        .sin_port           = htons(common->server_port),
+        .sin_addr.s_addr    = htonl(INADDR_LOOPBACK),
+    };
+
+    const char * const server_ip = common->server_ip;
+
+    if (server_ip != NULL) {
+        inet_pton(AF_INET, server_ip, &sockaddr.sin_addr);
+    }
+
+    connection->fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    connection->fill = 0;
+
+    if (UNLIKELY(connection->fd < 0)) {
+        return CREATE_SERVER_SOCKET_ACTION_CODE;
+    }
+
+    if (UNLIKELY(connect(connection->fd, (struct sockaddr *)&sockaddr, sizeof(sockaddr)) < 0)) {
+        return CONNECT_SERVER_ACTION_CODE;
+    }
+
+    // Same as the keyboard client, otherwise pongs queue behind unacknowledged batches
+    const int nodelay = 1;
+    setsockopt(connection->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    const midi_hello_t hello = {
+        .frame.type     = MIDI_FRAME_HELLO,
+        .frame.size     = htons(sizeof(midi_hello_t) - sizeof(midi_frame_t)),
+        .version        = MIDI_PROTOCOL_VERSION,
+        .channel        = channel,
+        .features       = htons(MIDI_FEATURES),
+    };
+
+    write(connection->fd, &hello, sizeof(hello));
+
+    *pollfd = (const struct pollfd) {
+        .fd         = connection->fd,
+        .events     = POLLIN,
+    };
+
+    return SUCCESS_ACTION_CODE;
+}
+
+// Waits on the sockets rather than sleeping, so a ping is answered as it lands and the clock estimate stays tight
+void bench_wait(bench_connection_t * const restrict connections, struct pollfd * const restrict pollfds,
+                const int count, const uint64_t deadline) {
+    for (uint64_t time = get_time_ns(); time < deadline; time = get_time_ns()) {
+        const struct timespec timespec = {
+            .tv_sec     = (deadline - time) / 1000000000,
+            .tv_nsec    = (deadline - time) % 1000000000,
+        };
+
+        if (ppoll(pollfds, count, &timespec, NULL) <= 0) {
+            continue;
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (pollfds[i].revents != 0) {
+                bench_pong(connections + i);
+            }
+        }
+    }
+}
+
+// Baseline of the server's counters, so the run can be charged its syscalls
+void bench_snapshot(common_t * const restrict common) {
+    const telemetry_t * const restrict telemetry = map_telemetry(common->telemetry_path, sizeof(telemetry_t), 0);
+
+    if (telemetry != NULL) {
+        common->bench_syscalls = counter_get(&telemetry->syscalls);
+        common->bench_events = counter_get(&telemetry->events);
+        common->bench_seq_writes = counter_get(&telemetry->seq_writes);
+    }
+
+    common->bench_telemetry = telemetry;
+}
+
+// The clock stops once the server has drained and closed every connection
+action_code_t bench_finish(const common_t * const restrict common, bench_connection_t * const restrict connections,
+                           const int count, const uint64_t events, const uint64_t start_time, const uint8_t has_pid) {
+    for (int i = 0; i < count; i++) {
+        shutdown(connections[i].fd, SHUT_WR);
+    }
+
+    for (int i = 0; i < count; i++) {
+        char buffer[256];
+        while (read(connections[i].fd, buffer, sizeof(buffer)) > 0);
+        close(connections[i].fd);
+    }
+
+    const uint64_t time = get_time_ns() - start_time;
+
+    printf("%d connections: %llu events in %llu ms, %llu events/s\n", count,
+        (unsigned long long)events, (unsigned long long)(time / 1000000),
+        (unsigned long long)(time > 0 ? events * 1000000000 / time : 0));
+
+    const telemetry_t * const restrict telemetry = common->bench_telemetry;
+
+    if (telemetry != NULL) {
+        const uint64_t syscalls = counter_get(&telemetry->syscalls) - common->bench_syscalls;
+        const uint64_t written = counter_get(&telemetry->events) - common->bench_events;
+
+        const uint64_t seq_writes = counter_get(&telemetry->seq_writes) - common->bench_seq_writes;
+
+        printf("Server: %llu syscalls for %llu events, %.3f per event, %.1f events per sequencer write\n",
+            (unsigned long long)syscalls, (unsigned long long)written,
+            (written > 0 ? (double)syscalls / written : 0.0), (seq_writes > 0 ? (double)written / seq_writes : 0.0));
+
+        munmap((void *)telemetry, sizeof(telemetry_t));
+    }
+
+    fflush(stdout);
+
+    return (has_pid ? view_stats(common) : SUCCESS_ACTION_CODE);
+}
+
+// Streams batch frames over every connection, as fast as the server takes them or at a total rate,
+// then prints what the running server measured
+action_code_t bench(common_t * const restrict common, int connections, const uint32_t rate) {
+    bench_connection_t bench_connections[CONFIG_MAX_CONNECTIONS];
+    struct pollfd pollfds[CONFIG_MAX_CONNECTIONS];
+
+    if (connections < 1 || connections > CONFIG_MAX_CONNECTIONS - 2) {
+        connections = (connections < 1 ? 1 : CONFIG_MAX_CONNECTIONS - 2);
+    }
+
+    pid_t pid;
+    const uint8_t has_pid = (read_pid(common, &pid) == SUCCESS_ACTION_CODE && kill(pid, SIGUSR2) == 0);
+
+    bench_snapshot(common);
+
+    for (int i = 0; i < connections; i++) {
+        const action_code_t action_code = bench_open(common, bench_connections + i, pollfds + i, 0);
+
+        if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+            return action_code;
+        }
+    }
+
+    // Unthrottled runs send big batches, paced runs send key presses
+    const uint32_t frame_events = (rate == 0 ? CONFIG_BENCH_EVENTS : 2);
+    const uint32_t frame_size = sizeof(midi_batch_t) + frame_events * sizeof(midi_event_t);
+    const uint64_t period = (rate == 0 ? 0 : 1000000000ull * connections * frame_events / rate);
+
+    struct {
+        midi_batch_t    batch;
+        midi_event_t    events[CONFIG_BENCH_EVENTS];
+    } PACKED message = {
+        .batch.frame.type   = MIDI_FRAME_BATCH,
+        .batch.frame.size   = htons(frame_size - sizeof(midi_frame_t)),
+    };
+
+    for (int i = 0; i < CONFIG_BENCH_EVENTS; i++) {
+        message.events[i] = (const midi_event_t) {
+            .key        = 60 + i / 2 % 12,
+            .velocity   = (i % 2 == 0 ? 100 : 0),
+        };
+    }
+
+    const uint64_t start_time = get_time_ns();
+    const uint64_t stop_time = start_time + CONFIG_BENCH_TIME * 1000000000ull;
+    uint64_t deadline = start_time;
+    uint64_t poll_time = start_time;
+    uint64_t events = 0;
+
+    while (1) {
+        const uint64_t now = get_time_ns();
+
+        if (now >= stop_time) {
+            break;
+        }
+
+        message.batch.scan_time = htobe64(now);
+        message.batch.send_time = message.batch.scan_time;
+
+        for (int i = 0; i < connections; i++) {
+            if (UNLIKELY(write(bench_connections[i].fd, &message, frame_size) != (int)frame_size)) {
+                return SEND_EVENTS_ACTION_CODE;
+            }
+        }
+
+        events += connections * frame_events;
+
+        if (period != 0) {
+            deadline += period;
+            bench_wait(bench_connections, pollfds, connections, deadline);
+        } else if (now - poll_time >= CONFIG_BENCH_POLL) {
+            poll_time = now;
+
+            for (int i = 0; i < connections; i++) {
+                bench_pong(bench_connections + i);
+            }
+        }
+    }
+
+    return bench_finish(common, bench_connections, connections, events, start_time, has_pid);
+}
+
+// Plays a journal back through a running server, one connection per recorded source, at its recorded pace
+// divided by speed or as fast as possible when speed is 0
+action_code_t replay(common_t * const restrict common, const char * const restrict path, const uint32_t speed) {
+    static bench_connection_t bench_connections[CONFIG_MAX_CONNECTIONS];
+    static struct pollfd pollfds[CONFIG_MAX_CONNECTIONS];
+    static uint16_t sources[CONFIG_MAX_CONNECTIONS + CONFIG_MAX_UDP_PEERS];
+
+    const int journal_fd = open(path, O_RDONLY);
+
+    if (UNLIKELY(journal_fd < 0)) {
+        return OPEN_JOURNAL_FILE_ACTION_CODE;
+    }
+
+    struct stat stat;
+    fstat(journal_fd, &stat);
+
+    const journal_header_t * const restrict header = (stat.st_size >= (off_t)sizeof(journal_header_t) ?
+        mmap(NULL, stat.st_size, PROT_READ, MAP_PRIVATE, journal_fd, 0) : MAP_FAILED);
+    close(journal_fd);
+
+    if (UNLIKELY(header == MAP_FAILED)) {
+        return READ_JOURNAL_FILE_ACTION_CODE;
+    }
+
+    if (UNLIKELY(memcmp(header->magic, JOURNAL_MAGIC, sizeof(header->magic)) != 0)) {
+        munmap((void *)header, stat.st_size);
+        return READ_JOURNAL_FILE_ACTION_CODE;
+    }
+
+    const journal_record_t * const restrict records = (const journal_record_t *)(header + 1);
+    uint64_t count = (stat.st_size - sizeof(journal_header_t)) / sizeof(journal_record_t);
+
+    // A journal that was not closed cleanly ends in zeroed records
+    for (uint64_t i = 0; i < count; i++) {
+        if (records[i].time == 0) {
+            count = i;
+            break;
+        }
+    }
+
+    // Nothing was recorded, there is nothing to pace or play
+    if (count == 0) {
+        munmap((void *)header, stat.st_size);
+        return SUCCESS_ACTION_CODE;
+    }
+
+    pid_t pid;
+    const uint8_t has_pid = (read_pid(common, &pid) == SUCCESS_ACTION_CODE && kill(pid, SIGUSR2) == 0);
+
+    bench_snapshot(common);
+
+    memset(sources, 0xFF, sizeof(sources));
+
+    int connections = 0;
+    uint64_t events = 0;
+    const uint64_t start_time = get_time_ns();
+    uint64_t poll_time = start_time;
+    uint64_t journal_time = 0;
+    uint64_t last_time = records[0].time;
+
+    struct {
+        midi_batch_t    batch;
+        midi_event_t    events[CONFIG_BENCH_EVENTS];
+    } PACKED message = {
+        .batch.frame.type   = MIDI_FRAME_BATCH,
+    };
+
+    for (uint64_t i = 0; i < count;) {
+        const journal_record_t * const restrict record = records + i;
+        const uint32_t source = record->source % (CONFIG_MAX_CONNECTIONS + CONFIG_MAX_UDP_PEERS);
+
+        // Another recording may have run on another boot, the pace picks up from its first record. Older
+        // journals have no session records, a clock that went back just adds nothing
+        if (record->source == JOURNAL_SESSION) {
+            last_time = record->time;
+            i++;
+            continue;
+        }
+
+        journal_time += (record->time > last_time ? record->time - last_time : 0);
+        last_time = record->time;
+
+        if (sources[source] == UINT16_MAX) {
+            if (UNLIKELY(connections == CONFIG_MAX_CONNECTIONS - 2)) {
+                i++;
+                continue;
+            }
+
+            const action_code_t action_code = bench_open(common, bench_connections + connections,
+                pollfds + connections, record->channel);
+
+            if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+                munmap((void *)header, stat.st_size);
+                return action_code;
+            }
+
+            sources[source] = connections++;
+        }
+
+        if (speed != 0) {
+            bench_wait(bench_connections, pollfds, connections, start_time + journal_time / speed);
+        } else if (get_time_ns() - poll_time >= CONFIG_BENCH_POLL) {
+            poll_time = get_time_ns();
+
+            for (int j = 0; j < connections; j++) {
+                bench_pong(bench_connections + j);
+            }
+        }
+
+        // Events one read delivered share a time and a source, they go out as one batch again
+        uint32_t batch = 0;
+
+        while (i < count && batch < CONFIG_BENCH_EVENTS &&
+               records[i].time == record->time && records[i].source == record->source) {
+            message.events[batch++] = records[i++].event;
+        }
+
+        const uint32_t frame_size = sizeof(midi_batch_t) + batch * sizeof(midi_event_t);
+
+        message.batch.frame.size = htons(frame_size - sizeof(midi_frame_t));
+        message.batch.scan_time = htobe64(get_time_ns());
+        message.batch.send_time = message.batch.scan_time;
+
+        if (UNLIKELY(write(bench_connections[sources[source]].fd, &message, frame_size) != (int)frame_size)) {
+            munmap((void *)header, stat.st_size);
+            return SEND_EVENTS_ACTION_CODE;
+        }
+
+        events += batch;
+    }
+
+    munmap((void *)header, stat.st_size);
+    return bench_finish(common, bench_connections, connections, events, start_time, has_pid);
+}
+
+int main(const int argc, char * const argv[]) {
+    process_t process = STANDARD_PROCESS;
+    uint8_t test_key = 0;
+    int bench_connections = 0;
+    uint32_t bench_rate = 0;
+    uint32_t replay_speed = 1;
+    const char * replay_path = NULL;
+
+    while (1) {
+        static const struct option options[] = {
+            {
+                .name       = "server",
+                .has_arg    = required_argument,
+                .flag       = NULL,
+                .val        = 's',
+            },
+            {
+                .name       = "batch",
+                .has_arg    = required_argument,
+                .flag       = NULL,
+                .val        = 'b',
+            },
+            {
+                .name       = "flush-time",
+                .has_arg    = required_argument,
+                .flag       = NULL,
+                .val        = 'F',
+            },
+            {
+                .name       = "playout",
+                .has_arg    = required_argument,
+                .flag       = NULL,
+                .val        = 'P',
+            },
+            {
+                .name       = "seq-device",
+                .has_arg    = required_argument,
+                .flag       = NULL,
+                .val        = 'S',
+            },
+            {
+                .name       = "output",
+                .has_arg    = required_argument,
+                .flag       = NULL,
+                .val        = 'o',
+            },
+            {
+                .name       = "config",
+                .has_arg    = required_argument,
+                .flag       = NULL,
+                .val        = 'f',
+            },
+            {
+                .name       = "bench",
+                .has_arg    = required_argument,
+                .flag       = NULL,
+                .val        = 'B',
+            },
+            {
+                .name       = "journal",
+                .has_arg    = required_argument,
+                .flag       = NULL,
+                .val        = 'J',
+            },
+            {
+                .name       = "replay",
+                .has_arg    = required_argument,
+                .flag       = NULL,
+                .val        = 'j',
+            },
+            {
+                .name       = "speed",
+                .has_arg    = required_argument,
+                .flag       = NULL,
+                .val        = 'x',
+            },
+            {
+                .name       = "rate",
+                .has_arg    = required_argument,
+                .flag       = NULL,
+                .val        = 'r',
+            },
+            {
+                .name       = "upgrade",
+                .has_arg    = no_argument,
+                .flag       = NULL,
+                .val        = 'u',
+            },
+            {
+                .name       = "io-uring",
+                .has_arg    = no_argument,
+                .flag       = NULL,
+                .val        = 'U',
+            },
+            COMMON_OPTIONS,
+            {   NULL, 0, NULL, 0    }
+        };
+
+        const int opt = getopt_long(argc, argv, "s:b:F:P:S:o:f:J:j:x:B:r:l:p:UquHvt:h", options, NULL);
+
+        if (UNLIKELY(opt < 0)) {
+            break;
+        }
+
+        if (common_option(&common, opt, &process, &test_key)) {
+            continue;
+        }
+
+        switch (opt) {
+            case 's': {
+                char * restrict port = strchr(optarg, ':');
+
+                if (port != NULL) {
+                    *port++ = '\0';
+                    common.server_port = atoi(port);
+                }
+
+                common.server_ip = optarg;
+            } break;
+            case 'b': {
+                if (UNLIKELY(!parse_batch(optarg, &common.seq_batch))) {
+                    return INVALID_OPTION_ACTION_CODE;
+                }
+            } break;
+            case 'F': {
+                const int flush_time = atoi(optarg);
+
+                if (UNLIKELY(flush_time < 0)) {
+                    return INVALID_OPTION_ACTION_CODE;
+                }
+
+                common.flush_time = flush_time * 1000ull;
+            } break;
+            case 'P': {
+                const int playout = atoi(optarg);
+
+                if (UNLIKELY(playout < 0)) {
+                    return INVALID_OPTION_ACTION_CODE;
+                }
+
+                common.playout_min = playout * 1000ull;
+            } break;
+            case 'S': common.seq_path = optarg; break;
+            case 'o': parse_seq_addr(optarg, &common.seq_connect); break;
+            case 'f': common.config_path = optarg; break;
+            case 'B': {
+                process = BENCH_PROCESS;
+                bench_connections = atoi(optarg);
             } break;
-            case 'l': common.log_path = optarg; break;
-            case 'p': common.pid_path = optarg; break;
-            case 'v': process = VIEW_LOG_PROCESS; break;
-            case 'q': process = QUIT_PROCESS; break;
-            case 't': {
-                process = TEST_PROCESS;
-                test_key = get_key(optarg);
+            case 'r': bench_rate = strtoul(optarg, NULL, 0); break;
+            case 'J': common.journal_path = optarg; break;
+            case 'j': {
+                process = REPLAY_PROCESS;
+                replay_path = optarg;
             } break;
+            case 'x': replay_speed = strtoul(optarg, NULL, 0); break;
+            case 'U': common.use_uring = 1; break;
+            case 'u': process = UPGRADE_PROCESS; break;
             case '?': case 'h': {
                 static const char help[] =
                     "GPIO-MIDI server v0.0.1\n"
                     "-s, --server\t:\tServer IP and port (127.0.0.1:9001)\n"
+                    "-b, --batch\t:\tMost events per sequencer write, 1-256 (256)\n"
+                    "-F, --flush-time\t:\tLongest an event waits for the rest of a wakeup before it is written, in us (250)\n"
+                    "-P, --playout\t:\tSchedule events at scan time plus at least N us on a sequencer queue (off)\n"
+                    "-S, --seq-device\t:\tSequencer device, a FIFO or /dev/null works as a sink (" SND_SEQ ")\n"
+                    "-o, --output\t:\tConnect the server's sequencer port to client:port, e.g. -o 128:0 (subscribers only)\n"
+                    "-f, --config\t:\tSettings file of batch, flush-time, output and route lines, reread on SIGHUP\n"
+                    "-B, --bench\t:\tStream events over N connections to a running server and print its stats\n"
+                    "-r, --rate\t:\tTotal events per second for --bench (as fast as possible)\n"
+                    "-J, --journal\t:\tRecord every received event to a journal file\n"
+                    "-j, --replay\t:\tPlay a journal file back through a running server\n"
+                    "-x, --speed\t:\tReplay speed, 0 for as fast as possible (1)\n"
                     "-l, --log-file\t:\tLog file (" APP_NAME ".log)\n"
                     "-p, --pid-file\t:\tPid file (" APP_NAME ".pid)\n"
+                    "-U, --io-uring\t:\tUse io_uring multishot receive instead of epoll, falls back when unsupported\n"
                     "-q, --quit\t:\tQuit daemod\n"
-                    "-v, --view-log\t:\tView log action code\n"
+                    "-u, --upgrade\t:\tStart a daemon that takes over the sockets and clients of the running one\n"
+                    "-H, --histograms\t:\tDump latency histograms of the running daemon\n"
+                    "-v, --view-log\t:\tView live counters and log action code\n"
                     "-t, --test\t:\tPlay test note (-t C#3 or -t Db4 or -t E5)\n"
                     "-h, --help\t:\tPrint this help info\n";
 
@@ -497,11 +3325,12 @@ int main(const int argc, char * const argv[]) {
     }
 
     switch (process) {
-        case STANDARD_PROCESS: return init(&common);
-        case VIEW_LOG_PROCESS: return view_log(&common);
-        case QUIT_PROCESS: return quit_proc(&common);
-        case TEST_PROCESS: return test(&common, test_key);
+        case STANDARD_PROCESS: inherit_sockets(&common); break;
+        case UPGRADE_PROCESS: return upgrade(&common);
+        case BENCH_PROCESS: return bench(&common, bench_connections, bench_rate);
+        case REPLAY_PROCESS: return replay(&common, replay_path, replay_speed);
+        default: break;
     }
 
-    return UNDEFINED_PROCESS_ACTION_CODE;
+    return run_process(&common, process, test_key);
 }
@@ -1,16 +1,369 @@
 #pragma once
 
+#include <sys/mman.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
 
 enum {
     CONFIG_TEST_KEY_TIMEOUT = 1,
     CONFIG_CONNECT_TIMEOUT  = 1,
+    CONFIG_RECONNECT_MIN    = 50 * 1000 * 1000,
+    CONFIG_RECONNECT_MAX    = 1000 * 1000 * 1000,
+    CONFIG_MAX_QUEUE_EVENTS = 1024,
+    CONFIG_RING_EVENTS      = 4096,
     CONFIG_MAX_GPIO_TIMEOUT = 64 * 1024,
-    CONFIG_MAX_EPOLL_EVENTS = 4,
-    CONFIG_MAX_MIDI_EVENTS  = 16,
+    CONFIG_MAX_EPOLL_EVENTS = 64,
+    CONFIG_MAX_MIDI_EVENTS  = 256,
+    CONFIG_SEQ_FLUSH_TIME   = 250,
+    CONFIG_MAX_CONNECTIONS  = 1024,
+    CONFIG_MAX_READ_SIZE    = 1024,
+    CONFIG_URING_ENTRIES    = 2048,
+    CONFIG_URING_BUFFERS    = 256,
+    CONFIG_MAX_GPIO_EVENTS  = 16,
+    CONFIG_DEBOUNCE_TIME    = 2000,
+    CONFIG_MAX_CURVE_POINTS = 16,
+    CONFIG_UDP_RESEND_TIME  = 5000,
+    CONFIG_MAX_UDP_PEERS    = 64,
+    CONFIG_UDP_PEER_TIMEOUT = 60,
+    CONFIG_MAX_ROUTES       = 32,
+    CONFIG_MAX_ROUTE_DEVICES = 8,
+    CONFIG_MAX_ROUTE_TARGETS = 4096,
+    CONFIG_MAX_DATAGRAM     = 1500,
+    CONFIG_STATS_TIMEOUT    = 1000 * 1000,
+    CONFIG_STATS_POLL       = 10 * 1000,
+    CONFIG_HANDOVER_TIMEOUT = 2000,
+    CONFIG_RT_PRIORITY      = 50,
+    CONFIG_HIST_BUCKETS     = 136,
+    CONFIG_PING_INTERVAL    = 1000 * 1000 * 1000,
+    CONFIG_SYNC_SAMPLES     = 8,
+    CONFIG_PLAYOUT_WINDOW   = 1000 * 1000 * 1000,
+    CONFIG_PLAYOUT_MARGIN   = 1000 * 1000,
+    CONFIG_PLAYOUT_MAX      = 200 * 1000 * 1000,
+    CONFIG_BENCH_TIME       = 2,
+    CONFIG_BENCH_EVENTS     = 64,
+    CONFIG_BENCH_POLL       = 10 * 1000 * 1000,
+    CONFIG_BENCH_SCAN_RATE  = 1000,
+    CONFIG_BENCH_NET_DELAY  = 5000,
+    CONFIG_MAX_SIM_EVENTS   = 1024,
+    CONFIG_MAX_SIM_BOUNCES  = 8,
+    CONFIG_SIM_SETTLE       = 10 * 1000 * 1000,
+    CONFIG_JOURNAL_SEGMENT  = 1024 * 1024,
+    CONFIG_TELEMETRY_SAMPLE = 500 * 1000,
+    TELEMETRY_MAGIC         = 0x544d4947,
+    MIDI_NOTES              = 128,
+    MIDI_CHANNELS           = 16,
 };
 
+// Version 1 is the bare two-byte event stream, a client that never says hello speaks it
+enum {
+    MIDI_PROTOCOL_LEGACY    = 1,
+    MIDI_PROTOCOL_VERSION   = 2,
+};
+
+typedef enum {
+    MIDI_FEATURE_STAMP      = 1 << 0,
+    MIDI_FEATURE_BATCH      = 1 << 1,
+    MIDI_FEATURE_DEVICE     = 1 << 2,
+    MIDI_FEATURES           = MIDI_FEATURE_STAMP | MIDI_FEATURE_BATCH | MIDI_FEATURE_DEVICE,
+} midi_feature_t;
+
+// Frames start with the top bit set, which a legacy note number never has
+typedef enum {
+    MIDI_FRAME_FLAG         = 0x80,
+    MIDI_FRAME_STAMP        = MIDI_FRAME_FLAG,
+    MIDI_FRAME_PING,
+    MIDI_FRAME_PONG,
+    MIDI_FRAME_DATAGRAM,
+    MIDI_FRAME_HELLO,
+    MIDI_FRAME_WELCOME,
+    MIDI_FRAME_BATCH,
+} midi_frame_type_t;
+
 typedef struct {
     uint8_t key;
     uint8_t velocity;
 } midi_event_t;
+
+// Multi-byte frame fields are in network byte order, size counts the bytes after the header
+typedef struct __attribute__((packed)) {
+    uint8_t     type;
+    uint8_t     flags;
+    uint16_t    size;
+} midi_frame_t;
+
+// Client scan and send times for the events following it
+typedef struct __attribute__((packed)) {
+    midi_frame_t    frame;
+    uint64_t        scan_time;
+    uint64_t        send_time;
+} midi_stamp_t;
+
+// Client hello offers its version and features, the server welcome answers with what both support;
+// channel and device only count when MIDI_FEATURE_DEVICE is agreed. Over TCP the server greets first with
+// a hello of its own, a legacy server would play a client's hello as notes
+typedef struct __attribute__((packed)) {
+    midi_frame_t    frame;
+    uint8_t         version;
+    uint8_t         channel;
+    uint16_t        features;
+    uint32_t        device;
+} midi_hello_t;
+
+// One header for a whole scan's events, their count follows from the frame size
+typedef struct __attribute__((packed)) {
+    midi_frame_t    frame;
+    uint64_t        scan_time;
+    uint64_t        send_time;
+    midi_event_t    events[];
+} midi_batch_t;
+
+// Server pings with its time, client echoes it back with its own
+typedef struct __attribute__((packed)) {
+    midi_frame_t    frame;
+    uint64_t        server_time;
+    uint64_t        client_time;
+} midi_sync_t;
+
+// Datagram carries the previous datagram's events as a journal ahead of its own,
+// so one lost datagram is recovered exactly; notes is the sender's sounding set
+typedef struct __attribute__((packed)) {
+    midi_frame_t    frame;
+    uint32_t        session;
+    uint32_t        sequence;
+    uint64_t        scan_time;
+    uint64_t        send_time;
+    uint8_t         count;
+    uint8_t         journal;
+    uint8_t         notes[MIDI_NOTES / 8];
+    midi_event_t    events[];
+} midi_datagram_t;
+
+typedef struct {
+    uint64_t    count;
+    uint64_t    sum;
+    uint64_t    max;
+    uint64_t    buckets[CONFIG_HIST_BUCKETS];
+} hist_t;
+
+// Leads each daemon's shared telemetry segment, size tells a reader built from other sources apart
+typedef struct {
+    uint32_t    magic;
+    uint32_t    size;
+    uint64_t    pid;
+    uint64_t    start_time;
+} telemetry_header_t;
+
+// Every counter has a single writer, so a relaxed load and store is enough for readers in other processes
+// and compiles to plain moves
+static inline void counter_add(uint64_t * const counter, const uint64_t value) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+static inline void counter_set(uint64_t * const counter, const uint64_t value) {
+    __atomic_store_n(counter, value, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t counter_get(const uint64_t * const counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t get_time_ns(void) {
+    struct timespec timespec;
+    clock_gettime(CLOCK_MONOTONIC, &timespec);
+
+    return timespec.tv_sec * 1000000000ull + timespec.tv_nsec;
+}
+
+// Four linear sub-buckets per power of two, values below 4 get a bucket each
+static inline uint32_t hist_bucket(const uint64_t value) {
+    if (value < 4) {
+        return value;
+    }
+
+    const uint32_t msb = 63 - __builtin_clzll(value);
+    const uint32_t bucket = (msb - 1) * 4 + ((value >> (msb - 2)) & 3);
+
+    return (bucket < CONFIG_HIST_BUCKETS ? bucket : CONFIG_HIST_BUCKETS - 1);
+}
+
+static inline uint64_t hist_value(const uint32_t bucket) {
+    if (bucket < 4) {
+        return bucket;
+    }
+
+    return (uint64_t)(4 + bucket % 4) << (bucket / 4 - 1);
+}
+
+static inline void hist_add_n(hist_t * const restrict hist, const uint64_t value, const uint32_t count) {
+    counter_add(&hist->count, count);
+    counter_add(&hist->sum, value * count);
+    counter_add(hist->buckets + hist_bucket(value), count);
+
+    if (value > counter_get(&hist->max)) {
+        counter_set(&hist->max, value);
+    }
+}
+
+static inline void hist_add(hist_t * const restrict hist, const uint64_t value) {
+    hist_add_n(hist, value, 1);
+}
+
+// Upper bound of the bucket holding the given rank, in parts per 10000
+static inline uint64_t hist_percentile(const hist_t * const restrict hist, const uint32_t rank) {
+    const uint64_t target = (hist->count * rank + 9999) / 10000;
+    uint64_t count = 0;
+
+    for (uint32_t i = 0; i < CONFIG_HIST_BUCKETS - 1; i++) {
+        count += hist->buckets[i];
+
+        if (count >= target) {
+            const uint64_t value = hist_value(i + 1) - 1;
+            return (value < hist->max ? value : hist->max);
+        }
+    }
+
+    return hist->max;
+}
+
+static inline void write_hist(const int fd, const char * const restrict name, const hist_t * const restrict hist) {
+    dprintf(fd, "%s: %llu events, avg %llu ns, p50 %llu ns, p99 %llu ns, p999 %llu ns, max %llu ns\n", name,
+        (unsigned long long)hist->count,
+        (unsigned long long)(hist->count > 0 ? hist->sum / hist->count : 0),
+        (unsigned long long)hist_percentile(hist, 5000),
+        (unsigned long long)hist_percentile(hist, 9900),
+        (unsigned long long)hist_percentile(hist, 9990),
+        (unsigned long long)hist->max);
+}
+
+typedef enum {
+    TELEMETRY_COUNT,
+    TELEMETRY_RATE,
+    TELEMETRY_CODE,
+    TELEMETRY_HIST,
+} telemetry_kind_t;
+
+// One line of the telemetry view, a daemon lists its own counters by where they sit in its telemetry_t
+typedef struct {
+    const char *    name;
+    uint32_t        offset;
+    uint8_t         kind;
+} telemetry_counter_t;
+
+#define TELEMETRY_COUNTER(name, field, kind) { name, offsetof(telemetry_t, field), kind }
+
+// Rates compare each counter with the sample taken time ns before
+static inline void print_telemetry(const void * const telemetry, const void * const sample, const uint64_t time,
+                                   const telemetry_counter_t * const counters, const uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        const char * const name = counters[i].name;
+        const uint64_t * const counter = (const uint64_t *)((const uint8_t *)telemetry + counters[i].offset);
+        const uint64_t first = *(const uint64_t *)((const uint8_t *)sample + counters[i].offset);
+
+        switch (counters[i].kind) {
+            case TELEMETRY_COUNT: printf("%s: %llu\n", name, (unsigned long long)counter_get(counter)); break;
+            case TELEMETRY_RATE: {
+                printf("%s: %llu, %llu/s\n", name, (unsigned long long)counter_get(counter),
+                    (unsigned long long)((counter_get(counter) - first) * 1000000000 / time));
+            } break;
+            case TELEMETRY_CODE: printf("%s: %d\n", name, (int)(int8_t)counter_get(counter)); break;
+            case TELEMETRY_HIST: {
+                fflush(stdout);
+                write_hist(STDOUT_FILENO, name, (const hist_t *)counter);
+            } break;
+        }
+    }
+
+    fflush(stdout);
+}
+
+// The whole string as a number from min to max, hex with 0x. Returns 0 for anything else
+static inline uint8_t parse_number(const char * const restrict string, const long long min,
+                                    const long long max, long long * const restrict value) {
+    char * end;
+
+    errno = 0;
+    const long long number = strtoll(string, &end, 0);
+
+    if (end == string || *end != '\0' || errno != 0 || number < min || number > max) {
+        return 0;
+    }
+
+    *value = number;
+    return 1;
+}
+
+// Maps a daemon's telemetry segment, created and sized by the writer, read only for everyone else
+static inline void * map_telemetry(const char * const path, const uint32_t size, const uint8_t writer) {
+    const int fd = (writer ? open(path, O_RDWR | O_CREAT | O_TRUNC, 0644) : open(path, O_RDONLY));
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (writer && ftruncate(fd, size) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    void * const map = mmap(NULL, size, (writer ? PROT_READ | PROT_WRITE : PROT_READ), MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    const telemetry_header_t * const header = map;
+
+    if (!writer && (header->magic != TELEMETRY_MAGIC || header->size != size)) {
+        munmap(map, size);
+        return NULL;
+    }
+
+    return map;
+}
+
+// Settings files hold "name value" lines, value is the rest of the line and NULL when there is none.
+// A # starting a word comments out the rest of the line, blank lines are skipped
+static inline uint8_t read_setting(FILE * const file, char * const line, const int size,
+                                   const char ** const name, const char ** const value) {
+    while (fgets(line, size, file) != NULL) {
+        for (char * comment = strchr(line, '#'); comment != NULL; comment = strchr(comment + 1, '#')) {
+            if (comment == line || comment[-1] == ' ' || comment[-1] == '\t') {
+                *comment = '\0';
+                break;
+            }
+        }
+
+        char * save;
+        *name = strtok_r(line, " \t\r\n", &save);
+        char * rest = strtok_r(NULL, "\r\n", &save);
+
+        if (*name == NULL) {
+            continue;
+        }
+
+        if (rest != NULL) {
+            char * end = rest + strlen(rest);
+
+            while (*rest == ' ' || *rest == '\t') {
+                rest++;
+            }
+
+            while (end > rest && (end[-1] == ' ' || end[-1] == '\t')) {
+                *--end = '\0';
+            }
+        }
+
+        *value = (rest != NULL && *rest != '\0' ? rest : NULL);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,480 @@
+#pragma once
+
+// Daemon plumbing the server and the RPI client share. Each includes it after its own common_t, telemetry_t,
+// telemetry_counters, action_code_t, process_t, DAEMON_SIGNALS and the common instance, the code here goes by the names both give them
+#include <sys/ioctl.h>
+#include <sys/file.h>
+#include <signal.h>
+#include <getopt.h>
+#include <stdlib.h>
+#ifndef LOCAL
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+// Each daemon defines these: init_daemon() is the work of the forked child, started_daemon() what the
+// parent does with its pid, close_daemon() closes what only that daemon opens and says whether the pid file
+// and telemetry are still its own, daemon_signal() takes the signals of DAEMON_SIGNALS
+static action_code_t init_daemon(common_t * const restrict common);
+static action_code_t started_daemon(common_t * const restrict common, const pid_t pid);
+static uint8_t close_daemon(common_t * const restrict common, const action_code_t action_code);
+static void daemon_signal(const int code);
+#ifdef LOCAL
+static action_code_t test(common_t * const restrict common, const uint8_t key);
+#endif
+
+// Long options every daemon takes, common_option() handles all of them but help
+#define COMMON_OPTIONS \
+    { \
+        .name       = "log-file", \
+        .has_arg    = required_argument, \
+        .flag       = NULL, \
+        .val        = 'l', \
+    }, \
+    { \
+        .name       = "pid-file", \
+        .has_arg    = required_argument, \
+        .flag       = NULL, \
+        .val        = 'p', \
+    }, \
+    { \
+        .name       = "quit", \
+        .has_arg    = no_argument, \
+        .flag       = NULL, \
+        .val        = 'q', \
+    }, \
+    { \
+        .name       = "histograms", \
+        .has_arg    = no_argument, \
+        .flag       = NULL, \
+        .val        = 'H', \
+    }, \
+    { \
+        .name       = "view-log", \
+        .has_arg    = no_argument, \
+        .flag       = NULL, \
+        .val        = 'v', \
+    }, \
+    { \
+        .name       = "test", \
+        .has_arg    = required_argument, \
+        .flag       = NULL, \
+        .val        = 't', \
+    }, \
+    { \
+        .name       = "help", \
+        .has_arg    = no_argument, \
+        .flag       = NULL, \
+        .val        = 'h', \
+    }
+
+// Taken before the fork and left open, the daemon holds it shared until it exits. An upgrade's new process
+// takes it alongside the old one
+static void lock_pid(const common_t * const restrict common) {
+    const int pid_fd = open(common->pid_path, O_RDONLY | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP);
+
+    if (pid_fd >= 0) {
+        flock(pid_fd, LOCK_SH);
+    }
+}
+
+// A pid file nobody holds the lock on was left by a daemon that died, its pid may be anyone's by now
+static action_code_t read_pid(const common_t * const restrict common, pid_t * const restrict pid) {
+    const int pid_fd = open(common->pid_path, O_RDONLY);
+
+    if (UNLIKELY(pid_fd < 0)) {
+        return OPEN_PID_FILE_ACTION_CODE;
+    }
+
+    const int result = read(pid_fd, pid, sizeof(*pid));
+    const int stale = (flock(pid_fd, LOCK_EX | LOCK_NB) == 0);
+    close(pid_fd);
+
+    if (UNLIKELY(result != sizeof(*pid))) {
+        return READ_PID_FILE_ACTION_CODE;
+    }
+
+    if (UNLIKELY(stale)) {
+        return STALE_PID_FILE_ACTION_CODE;
+    }
+
+    return SUCCESS_ACTION_CODE;
+}
+
+// Run by the parent after the fork, a daemon nobody can find again is stopped
+static action_code_t write_pid(const common_t * const restrict common, const pid_t pid) {
+    const int pid_fd = open(common->pid_path,
+        O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP);
+
+    if (UNLIKELY(pid_fd < 0)) {
+        return OPEN_PID_FILE_ACTION_CODE;
+    }
+
+    const int result = write(pid_fd, &pid, sizeof(pid));
+    close(pid_fd);
+
+    if (UNLIKELY(result != sizeof(pid))) {
+        kill(pid, SIGTERM);
+        return WRITE_PID_FILE_ACTION_CODE;
+    }
+
+    return SUCCESS_ACTION_CODE;
+}
+
+static action_code_t quit_proc(const common_t * const restrict common) {
+    pid_t pid;
+    const action_code_t action_code = read_pid(common, &pid);
+
+    if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+        return action_code;
+    }
+
+    kill(pid, SIGTERM);
+    return SUCCESS_ACTION_CODE;
+}
+
+static action_code_t view_stats(const common_t * const restrict common) {
+    pid_t pid;
+    const action_code_t action_code = read_pid(common, &pid);
+
+    if (action_code != SUCCESS_ACTION_CODE) {
+        return action_code;
+    }
+
+    unlink(common->stats_path);
+
+    if (kill(pid, SIGUSR1) < 0) {
+        return SIGNAL_PROCESS_ACTION_CODE;
+    }
+
+    int stats_fd = -1;
+
+    for (int timeout = 0; timeout < CONFIG_STATS_TIMEOUT; timeout += CONFIG_STATS_POLL) {
+        usleep(CONFIG_STATS_POLL);
+        stats_fd = open(common->stats_path, O_RDONLY);
+
+        if (stats_fd >= 0) {
+            break;
+        }
+    }
+
+    if (UNLIKELY(stats_fd < 0)) {
+        return OPEN_STATS_FILE_ACTION_CODE;
+    }
+
+    while (1) {
+        char buffer[4096];
+        const int result = read(stats_fd, buffer, sizeof(buffer));
+
+        if (result <= 0) {
+            close(stats_fd);
+            return (result < 0 ? READ_STATS_FILE_ACTION_CODE : SUCCESS_ACTION_CODE);
+        }
+
+        write(STDOUT_FILENO, buffer, result);
+    }
+}
+
+// Samples the running daemon's counters twice, the daemon itself does nothing for it
+static action_code_t view_telemetry(const common_t * const restrict common) {
+    const telemetry_t * const restrict telemetry = map_telemetry(common->telemetry_path, sizeof(telemetry_t), 0);
+
+    if (telemetry == NULL) {
+        return OPEN_TELEMETRY_ACTION_CODE;
+    }
+
+    telemetry_t sample;
+    memcpy(&sample, telemetry, sizeof(sample));
+
+    const uint64_t first_time = get_time_ns();
+    usleep(CONFIG_TELEMETRY_SAMPLE);
+
+    const uint64_t time = get_time_ns() - first_time;
+    const uint64_t uptime = get_time_ns() - telemetry->header.start_time;
+
+    printf("Pid %llu, up %llu s\n", (unsigned long long)telemetry->header.pid,
+        (unsigned long long)(uptime / 1000000000));
+    print_telemetry(telemetry, &sample, time, telemetry_counters,
+        sizeof(telemetry_counters) / sizeof(telemetry_counters[0]));
+
+    munmap((void *)telemetry, sizeof(telemetry_t));
+    return SUCCESS_ACTION_CODE;
+}
+
+static action_code_t view_log(const common_t * const restrict common) {
+    view_telemetry(common);
+
+    const int log_fd = open(common->log_path, O_RDONLY);
+
+    if (UNLIKELY(log_fd < 0)) {
+        return OPEN_LOG_FILE_ACTION_CODE;
+    }
+
+    action_code_t action_code;
+    const int result = read(log_fd, &action_code, sizeof(action_code));
+    close(log_fd);
+
+    if (UNLIKELY(result != sizeof(action_code))) {
+        return READ_LOG_FILE_ACTION_CODE;
+    }
+
+    printf("Log: %d\n", action_code);
+    return SUCCESS_ACTION_CODE;
+}
+
+// Last thing destroy() does, what view_log() reads back
+static action_code_t write_log(const common_t * const restrict common, const action_code_t action_code) {
+    const int log_fd = open(common->log_path,
+        O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP);
+
+    if (UNLIKELY(log_fd < 0)) {
+        return OPEN_LOG_FILE_ACTION_CODE;
+    }
+
+    const int result = write(log_fd, &action_code, sizeof(action_code));
+    close(log_fd);
+
+    if (UNLIKELY(result != sizeof(action_code))) {
+        return WRITE_LOG_FILE_ACTION_CODE;
+    }
+
+    return SUCCESS_ACTION_CODE;
+}
+
+static action_code_t destroy(const action_code_t action_code) {
+    if (close_daemon(&common, action_code)) {
+        unlink(common.pid_path);
+        unlink(common.telemetry_path);
+    }
+
+    if (common.server_fd >= 0) {
+        close(common.server_fd);
+    }
+
+    return write_log(&common, action_code);
+}
+
+static void sig_proc(const int code) {
+    switch (code) {
+        case SIGSEGV: return (void)destroy(SIGSEGV_ACTION_CODE);
+        case SIGTERM: return (void)destroy(SIGTERM_ACTION_CODE);
+        case SIGUSR1: stats_requested = 1; return;
+        case SIGHUP: reload_requested = 1; return;
+    }
+
+    daemon_signal(code);
+}
+
+static action_code_t init(common_t * const restrict common) {
+    lock_pid(common);
+
+    pid_t pid = fork();
+
+    if (pid == SUCCESS_ACTION_CODE) {
+        static const int codes[] = { SIGSEGV, SIGINT, SIGUSR1, SIGHUP, DAEMON_SIGNALS };
+
+        for (uint32_t i = 0; i < sizeof(codes) / sizeof(codes[0]); i++) {
+            signal(codes[i], sig_proc);
+        }
+
+        signal(SIGPIPE, SIG_IGN);
+
+        close(STDERR_FILENO);
+        close(STDOUT_FILENO);
+        close(STDIN_FILENO);
+
+        return destroy(init_daemon(common));
+    }
+
+    return (pid > 0 ? started_daemon(common, pid) : FORK_ACTION_CODE);
+}
+
+#ifndef LOCAL
+// Plays the note through the server's TCP port like any client would, without a hello
+static action_code_t test(common_t * const restrict common, const uint8_t key) {
+    const int server_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    if (UNLIKELY(server_fd < 0)) {
+        return CREATE_SERVER_SOCKET_ACTION_CODE;
+    }
+
+    struct sockaddr_in sockaddr = {
+        .sin_family         = AF_INET,
+        .sin_port           = htons(common->server_port),
+        .sin_addr.s_addr    = htonl(INADDR_LOOPBACK),
+    };
+
+    const char * const server_ip = common->server_ip;
+
+    if (server_ip != NULL) {
+        inet_pton(AF_INET, server_ip, &sockaddr.sin_addr);
+    }
+
+    int result = connect(server_fd, (struct sockaddr *)&sockaddr, sizeof(sockaddr));
+
+    if (UNLIKELY(result < 0)) {
+        close(server_fd);
+        return CONNECT_SERVER_ACTION_CODE;
+    }
+
+    midi_event_t event = {
+        .key        = key,
+        .velocity   = 100,
+    };
+
+    result = write(server_fd, &event, sizeof(event));
+
+    if (UNLIKELY(result != sizeof(event))) {
+        close(server_fd);
+        return SEND_EVENTS_ACTION_CODE;
+    }
+
+    event.velocity = 0;
+    sleep(CONFIG_TEST_KEY_TIMEOUT);
+
+    result = write(server_fd, &event, sizeof(event));
+    close(server_fd);
+
+    if (UNLIKELY(result != sizeof(event))) {
+        return SEND_EVENTS_ACTION_CODE;
+    }
+
+    return SUCCESS_ACTION_CODE;
+}
+#endif
+
+// The processes every daemon has, main() runs its own ones and leaves the rest to this
+static action_code_t run_process(common_t * const restrict common, const process_t process, const uint8_t test_key) {
+    switch (process) {
+        case STANDARD_PROCESS: return init(common);
+        case VIEW_LOG_PROCESS: return view_log(common);
+        case VIEW_STATS_PROCESS: return view_stats(common);
+        case QUIT_PROCESS: return quit_proc(common);
+        case TEST_PROCESS: return test(common, test_key);
+        default: return UNDEFINED_PROCESS_ACTION_CODE;
+    }
+}
+
+static uint8_t get_key(const char * const restrict arg) {
+    uint8_t key = 0;
+
+    switch (arg[0]) {
+        case 'C': key = 0; break;
+        case 'D': key = 2; break;
+        case 'E': key = 4; break;
+        case 'F': key = 5; break;
+        case 'G': key = 7; break;
+        case 'A': key = 9; break;
+        case 'B': key = 11; break;
+    }
+
+    char next_c = arg[2];
+
+    switch (arg[1]) {
+        case '#': key++; break;
+        case 'b': key--; break;
+        default: next_c = arg[1];
+    }
+
+    return key + (next_c - '0') * 12;
+}
+
+// Returns 0 for options it leaves to the caller
+static uint8_t common_option(common_t * const restrict common, const int opt, process_t * const restrict process,
+                             uint8_t * const restrict test_key) {
+    switch (opt) {
+        case 'l': common->log_path = optarg; return 1;
+        case 'p': common->pid_path = optarg; return 1;
+        case 'H': *process = VIEW_STATS_PROCESS; return 1;
+        case 'v': *process = VIEW_LOG_PROCESS; return 1;
+        case 'q': *process = QUIT_PROCESS; return 1;
+        case 't': {
+            *process = TEST_PROCESS;
+            *test_key = get_key(optarg);
+        } return 1;
+    }
+
+    return 0;
+}
+
+#ifdef SND_SEQ
+// "client:port", a bare client number means port 0
+static void parse_seq_addr(const char * const restrict string, struct snd_seq_addr * const restrict addr) {
+    char * port = NULL;
+
+    addr->client = strtoul(string, &port, 0);
+    addr->port = (*port == ':' ? strtoul(port + 1, NULL, 0) : 0);
+}
+
+// Names the daemon's sequencer client and gives it one output port, events go to whoever subscribes to it.
+// A FIFO or /dev/null sink takes the events as they are
+static action_code_t register_seq(common_t * const restrict common) {
+    const int seq_fd = common->seq_fd;
+    int client;
+
+    if (ioctl(seq_fd, SNDRV_SEQ_IOCTL_CLIENT_ID, &client) < 0) {
+        return SUCCESS_ACTION_CODE;
+    }
+
+    struct snd_seq_client_info client_info = {
+        .client     = client,
+    };
+
+    if (UNLIKELY(ioctl(seq_fd, SNDRV_SEQ_IOCTL_GET_CLIENT_INFO, &client_info) < 0)) {
+        return SET_SEQ_CLIENT_ACTION_CODE;
+    }
+
+    snprintf(client_info.name, sizeof(client_info.name), "%s", APP_NAME);
+
+    if (UNLIKELY(ioctl(seq_fd, SNDRV_SEQ_IOCTL_SET_CLIENT_INFO, &client_info) < 0)) {
+        return SET_SEQ_CLIENT_ACTION_CODE;
+    }
+
+    struct snd_seq_port_info port_info = {
+        .addr.client    = client,
+        .name           = APP_NAME " out",
+        .capability     = SNDRV_SEQ_PORT_CAP_READ | SNDRV_SEQ_PORT_CAP_SUBS_READ,
+        .type           = SNDRV_SEQ_PORT_TYPE_MIDI_GENERIC | SNDRV_SEQ_PORT_TYPE_APPLICATION,
+        .midi_channels  = MIDI_CHANNELS,
+    };
+
+    if (UNLIKELY(ioctl(seq_fd, SNDRV_SEQ_IOCTL_CREATE_PORT, &port_info) < 0)) {
+        return CREATE_SEQ_PORT_ACTION_CODE;
+    } else {
+        common->seq_port = port_info.addr;
+    }
+
+    return SUCCESS_ACTION_CODE;
+}
+
+// Moves the port's subscription from one destination to another, the new one first so a bad address
+// leaves the old connection in place
+static action_code_t connect_seq(const common_t * const restrict common,
+                                 const struct snd_seq_addr * const restrict from,
+                                 const struct snd_seq_addr * const restrict to) {
+    struct snd_seq_port_subscribe subscribe = {
+        .sender     = common->seq_port,
+    };
+
+    if (common->seq_port.client == 0 ||
+        (from != NULL && from->client == to->client && from->port == to->port)) {
+        return SUCCESS_ACTION_CODE;
+    }
+
+    if (to->client != SNDRV_SEQ_ADDRESS_UNKNOWN) {
+        subscribe.dest = *to;
+
+        if (UNLIKELY(ioctl(common->seq_fd, SNDRV_SEQ_IOCTL_SUBSCRIBE_PORT, &subscribe) < 0)) {
+            return SUBSCRIBE_SEQ_PORT_ACTION_CODE;
+        }
+    }
+
+    if (from != NULL && from->client != SNDRV_SEQ_ADDRESS_UNKNOWN) {
+        subscribe.dest = *from;
+        ioctl(common->seq_fd, SNDRV_SEQ_IOCTL_UNSUBSCRIBE_PORT, &subscribe);
+    }
+
+    return SUCCESS_ACTION_CODE;
+}
+#endif
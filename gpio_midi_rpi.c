@@ -2,12 +2,28 @@
 #ifndef GPIO_CHIP
 #define GPIO_CHIP "/dev/gpiochip0"
 #endif
+#if defined(LOCAL) && !defined(SND_SEQ)
+#define SND_SEQ "/dev/snd/seq"
+#endif
+#define __USE_GNU
 #include <linux/gpio.h>
+#ifdef LOCAL
+#include <sound/asequencer.h>
+#endif
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <signal.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <endian.h>
+#include <errno.h>
+#include <time.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <string.h>
@@ -19,32 +35,304 @@
 #define UNUSED __attribute__((unused))
 #define PACKED __attribute__((packed))
 #define UNLIKELY(x) __builtin_expect(x, 0)
+#define TELEMETRY_PATH "/dev/shm/" APP_NAME "-client"
+
+#ifndef SCAN_FAST_COLUMNS
+#define SCAN_FAST_COLUMNS 8
+#endif
+
+enum {
+    MATRIX_ROWS         = 5,
+    MATRIX_COLUMNS      = 8,
+    MAX_ROWS            = 16,
+    MAX_COLUMNS         = 16,
+    MAX_SCAN_ROWS       = 2 * MAX_ROWS,
+    MAX_KEY_BITS        = MAX_ROWS * MAX_COLUMNS,
+    MATRIX_BITS         = 2 * MAX_KEY_BITS,
+    MATRIX_WORDS        = MATRIX_BITS / 64,
+    NO_KEY              = 0xFF,
+};
+
+// Wiring of the key matrix, keys are numbered up from the base note
+typedef struct {
+    uint8_t     rows;
+    uint8_t     columns;
+    uint8_t     second_rows;
+    uint8_t     base_note;
+    uint32_t    row_lines[MAX_ROWS];
+    uint32_t    column_lines[MAX_COLUMNS];
+    uint32_t    second_lines[MAX_ROWS];
+    uint8_t     keys[MAX_ROWS][MAX_COLUMNS];
+} geometry_t;
+
+// One entry per matrix bit so the scan never divides or looks up the key map
+typedef struct {
+    uint8_t     note;
+    uint8_t     row;
+    uint8_t     second;
+    uint8_t     reserved;
+    uint16_t    key;
+} scan_key_t;
+
+typedef struct {
+    uint32_t    time;
+    uint8_t     velocity;
+} velocity_point_t;
+
+// What SIGHUP can change, built whole on the sender and handed to the scanner by pointer
+typedef struct {
+    uint64_t            debounce_time;
+    uint8_t             velocity_points;
+    velocity_point_t    velocity_curve[CONFIG_MAX_CURVE_POINTS];
+    uint64_t            first_mask[MATRIX_WORDS];
+    uint64_t            matrix_mask[MATRIX_WORDS];
+    scan_key_t          scan_table[MATRIX_BITS];
+} config_t;
+
+// Live counters in shared memory, written by the daemon only
+typedef struct {
+    telemetry_header_t  header;
+    uint64_t            scans;
+    uint64_t            events;
+    uint64_t            connects;
+    uint64_t            gpio_ioctls;
+    uint64_t            queue_high;
+    uint64_t            queue_overflows;
+    uint64_t            resyncs;
+    uint64_t            send_failures;
+    uint64_t            ring_high;
+    uint64_t            ring_overflows;
+    uint64_t            reloads;
+    uint64_t            reload_failures;
+    uint64_t            reload_error;
+    hist_t              ioctl_time;
+    hist_t              reconnect_time;
+} telemetry_t;
+
+static telemetry_t telemetry_fallback;
+
+static const telemetry_counter_t telemetry_counters[] = {
+    TELEMETRY_COUNTER("Scans", scans, TELEMETRY_RATE),
+    TELEMETRY_COUNTER("Events", events, TELEMETRY_COUNT),
+    TELEMETRY_COUNTER("Connects", connects, TELEMETRY_COUNT),
+    TELEMETRY_COUNTER("GPIO ioctls", gpio_ioctls, TELEMETRY_RATE),
+    TELEMETRY_COUNTER("Ioctl time", ioctl_time, TELEMETRY_HIST),
+    TELEMETRY_COUNTER("Ring high", ring_high, TELEMETRY_COUNT),
+    TELEMETRY_COUNTER("Ring overflows", ring_overflows, TELEMETRY_COUNT),
+    TELEMETRY_COUNTER("Queue high", queue_high, TELEMETRY_COUNT),
+    TELEMETRY_COUNTER("Queue overflows", queue_overflows, TELEMETRY_COUNT),
+    TELEMETRY_COUNTER("Resyncs", resyncs, TELEMETRY_COUNT),
+    TELEMETRY_COUNTER("Failed sends", send_failures, TELEMETRY_COUNT),
+    TELEMETRY_COUNTER("Reloads", reloads, TELEMETRY_COUNT),
+    TELEMETRY_COUNTER("Failed reloads", reload_failures, TELEMETRY_COUNT),
+    TELEMETRY_COUNTER("Last reload error", reload_error, TELEMETRY_CODE),
+    TELEMETRY_COUNTER("Reconnect time", reconnect_time, TELEMETRY_HIST),
+};
+
+typedef struct {
+    uint64_t        scan_time;
+    midi_event_t    event;
+} ring_entry_t;
+
+// A scripted key change, times in ns from the start of the timeline
+typedef struct {
+    uint64_t    time;
+    uint32_t    travel;
+    uint8_t     note;
+    uint8_t     press;
+} sim_event_t;
+
+// One contact opening or closing, every bounce is an edge of its own
+typedef struct {
+    uint64_t    time;
+    uint8_t     row;
+    uint8_t     column;
+    uint8_t     closed;
+} sim_edge_t;
+
+// Stands in for the GPIO lines: the columns read back follow the timeline and whichever rows are driven
+typedef struct {
+    uint64_t    start;
+    uint64_t    end;
+    uint64_t    bounce_time;
+    uint64_t    latency;
+    uint64_t    rows;
+    uint32_t    bounces;
+    uint32_t    event_count;
+    uint32_t    edge_count;
+    uint32_t    next_edge;
+    uint32_t    closed[MAX_SCAN_ROWS];
+    sim_event_t events[CONFIG_MAX_SIM_EVENTS];
+    sim_edge_t  edges[CONFIG_MAX_SIM_EVENTS * 2 * (2 * CONFIG_MAX_SIM_BOUNCES + 1)];
+} sim_t;
+
+typedef struct gpio_backend gpio_backend_t;
+
+// Connect and handshake never block, the scan loop keeps running while the link comes up
+typedef enum PACKED {
+    LINK_DOWN,
+    LINK_CONNECTING,
+    LINK_GREETING,
+    LINK_HANDSHAKE,
+    LINK_UP,
+} link_state_t;
 
 typedef struct {
     const char *    log_path;
     const char *    pid_path;
     const char *    server_ip;
+    const char *    gpio_chip;
+    const char *    stats_path;
+    const char *    telemetry_path;
+    const char *    config_path;
+    const char *    geometry_path;
+    const char *    curve_path;
+    const char *    second_lines;
+    const char *    sim_path;
+    const gpio_backend_t * gpio;
+    telemetry_t *   telemetry;
+    config_t *      config;
+    config_t *      next_config;
+    config_t *      config_published;
+    uint64_t        scan_period;
+    uint64_t        scan_overruns;
+    uint64_t        debounce_time;
+    uint64_t        last_scan;
+    uint64_t        scan_time;
+    uint64_t        resend_at;
+    uint64_t        link_time;
+    uint64_t        down_time;
+    uint64_t        backoff;
+    uint64_t        net_delay;
+    hist_t          scan_late;
+    hist_t          scan_interval;
+#ifdef LOCAL
+    const char *    seq_path;
+    hist_t          total_latency;
+    hist_t          seq_latency;
+    struct snd_seq_addr seq_port;
+    struct snd_seq_addr seq_connect;
+    int             seq_fd;
+#endif
     int             server_fd;
     int             chip_fd;
-    int             out_fd;
-    int             in_fd;
+    int             line_fd;
+    int             wake_fd;
+    int             scan_cpu;
     short           server_port;
+    link_state_t    link;
+    uint8_t         realtime;
+    uint8_t         udp;
+    uint8_t         queue_overflow;
+    uint8_t         sender_waiting;
+    uint8_t         sender_stop;
+    uint8_t         reload;
+    int8_t          transpose;
+    uint8_t         dual_contact;
+    uint8_t         matrix_rows;
+    uint8_t         matrix_columns;
+    uint8_t         matrix_words;
+    uint8_t         velocity_points;
+    uint32_t        columns;
+    uint32_t        session;
+    uint32_t        sequence;
+    uint32_t        datagram_size;
+    uint32_t        rx_fill;
+    uint32_t        queue_head;
+    uint32_t        queue_tail;
+    uint32_t        device;
+    uint16_t        features;
+    uint8_t         channel;
+    uint32_t        key_bits;
+    geometry_t      geometry;
+    config_t        configs[2];
+    velocity_point_t velocity_curve[CONFIG_MAX_CURVE_POINTS];
+    uint64_t        rows;
+    uint64_t        rows_mask;
+    uint64_t        columns_mask;
+    uint64_t        row_bits[MAX_SCAN_ROWS];
+    uint64_t        sounding[MATRIX_WORDS];
+    uint64_t        matrix[MATRIX_WORDS];
+    uint64_t        locked[MATRIX_WORDS];
+    uint64_t        lock_until[MATRIX_BITS];
+    uint64_t        contact_time[MAX_KEY_BITS];
+    struct sockaddr_in server_addr;
+    uint8_t         held[MIDI_NOTES / 8];
+    uint8_t         delivered[MIDI_NOTES / 8];
+    uint8_t         unsure[MIDI_NOTES / 8];
+    uint8_t         velocities[MIDI_NOTES];
+    ring_entry_t    queue[CONFIG_MAX_QUEUE_EVENTS];
+    // Each index has one writer, the scanner owns the tail and the sender the head
+    uint32_t        ring_tail __attribute__((aligned(64)));
+    uint32_t        ring_head __attribute__((aligned(64)));
+    ring_entry_t    ring[CONFIG_RING_EVENTS] __attribute__((aligned(64)));
+    uint8_t         datagram[sizeof(midi_datagram_t) + 2 * MATRIX_BITS * sizeof(midi_event_t)];
+    uint8_t         rx_buffer[CONFIG_MAX_READ_SIZE];
+    sim_t           sim;
 } common_t;
 
 static common_t common = {
     .log_path       = APP_NAME ".log",
     .pid_path       = APP_NAME ".pid",
     .server_ip      = NULL,
+    .gpio_chip      = GPIO_CHIP,
+    .stats_path     = APP_NAME ".stats",
+    .telemetry_path = TELEMETRY_PATH,
+    .telemetry      = &telemetry_fallback,
+    .scan_period    = 0,
+    .debounce_time  = CONFIG_DEBOUNCE_TIME * 1000ull,
+#ifdef LOCAL
+    .seq_path       = SND_SEQ,
+    .seq_connect.client = SNDRV_SEQ_ADDRESS_UNKNOWN,
+    .seq_fd         = -1,
+#endif
     .server_fd      = -1,
     .chip_fd        = -1,
-    .out_fd         = -1,
-    .in_fd          = -1,
+    .line_fd        = -1,
+    .wake_fd        = -1,
+    .scan_cpu       = -1,
     .server_port    = 9001,
+    .link           = LINK_DOWN,
+    .realtime       = 0,
+    .udp            = 0,
+    .dual_contact   = 0,
+    .matrix_rows    = MATRIX_ROWS,
+    .matrix_columns = MATRIX_COLUMNS,
+    .matrix_words   = 1,
+    .columns        = 0,
+    .device         = 0,
+    .features       = 0,
+    .channel        = 0,
+    .velocity_points = 5,
+    .velocity_curve = {
+        { .time = 1000,     .velocity = 127 },
+        { .time = 3000,     .velocity = 100 },
+        { .time = 10000,    .velocity = 64  },
+        { .time = 30000,    .velocity = 32  },
+        { .time = 100000,   .velocity = 1   },
+    },
+    .geometry       = {
+        .rows           = MATRIX_ROWS,
+        .columns        = MATRIX_COLUMNS,
+        .second_rows    = 0,
+        .base_note      = 3 * 12, // 3 octave offset
+        .row_lines      = { 7, 8, 15, 17, 27 },
+        .column_lines   = { 11, 9, 25, 10, 24, 23, 22, 18 },
+        .keys           = {
+            [0 ... MAX_ROWS - 1][0 ... MAX_COLUMNS - 1] = NO_KEY,
+        },
+    },
+    .rows           = 0,
+    .rows_mask      = 0,
 };
 
+static volatile sig_atomic_t stats_requested = 0;
+static volatile sig_atomic_t reload_requested = 0;
+
 typedef enum PACKED {
     SUCCESS_ACTION_CODE,
     UNDEFINED_PROCESS_ACTION_CODE = -128,
+    INVALID_OPTION_ACTION_CODE,
 
     OPEN_LOG_FILE_ACTION_CODE,
     READ_LOG_FILE_ACTION_CODE,
@@ -56,490 +344,2461 @@ typedef enum PACKED {
     OPEN_PID_FILE_ACTION_CODE,
     READ_PID_FILE_ACTION_CODE,
     WRITE_PID_FILE_ACTION_CODE,
+    STALE_PID_FILE_ACTION_CODE,
 
     FORK_ACTION_CODE,
     OPEN_GPIO_CHIP_ACTION_CODE,
-    IOCTL_GPIO_OUT_ACTION_CODE,
-    IOCTL_GPIO_IN_ACTION_CODE,
+    IOCTL_GPIO_LINES_ACTION_CODE,
+    SCHED_FIFO_ACTION_CODE,
+    MLOCKALL_ACTION_CODE,
 
     CREATE_SERVER_SOCKET_ACTION_CODE,
     IOCTL_GPIO_SET_ACTION_CODE,
     IOCTL_GPIO_GET_ACTION_CODE,
+    POLL_GPIO_EVENTS_ACTION_CODE,
     SEND_EVENTS_ACTION_CODE,
 
     CONNECT_SERVER_ACTION_CODE,
+    READ_SERVER_ACTION_CODE,
+    OPEN_SND_SEQ_ACTION_CODE,
+    SET_SEQ_CLIENT_ACTION_CODE,
+    CREATE_SEQ_PORT_ACTION_CODE,
+    SUBSCRIBE_SEQ_PORT_ACTION_CODE,
+    SIGNAL_PROCESS_ACTION_CODE,
+    OPEN_TELEMETRY_ACTION_CODE,
+    OPEN_STATS_FILE_ACTION_CODE,
+    READ_STATS_FILE_ACTION_CODE,
+    OPEN_CURVE_FILE_ACTION_CODE,
+    READ_CURVE_FILE_ACTION_CODE,
+    OPEN_GEOMETRY_FILE_ACTION_CODE,
+    READ_GEOMETRY_FILE_ACTION_CODE,
+    OPEN_SIM_FILE_ACTION_CODE,
+    READ_SIM_FILE_ACTION_CODE,
+    OPEN_CONFIG_FILE_ACTION_CODE,
+    READ_CONFIG_FILE_ACTION_CODE,
+    CHANGED_WIRING_ACTION_CODE,
+    CREATE_SENDER_ACTION_CODE,
+    CREATE_BENCH_PIPE_ACTION_CODE,
+    CREATE_BENCH_SINK_ACTION_CODE,
+    SCAN_CPU_ACTION_CODE,
 } action_code_t;
 
-action_code_t main_loop(common_t * const restrict common) {
-    const int server_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+typedef enum {
+    STANDARD_PROCESS,
+    VIEW_LOG_PROCESS,
+    VIEW_STATS_PROCESS,
+    QUIT_PROCESS,
+    TEST_PROCESS,
+    BENCH_PROCESS,
+} process_t;
 
-    if (UNLIKELY(server_fd < 0)) {
-        return CREATE_SERVER_SOCKET_ACTION_CODE;
-    } else {
-        common->server_fd = server_fd;
-    }
+#define DAEMON_SIGNALS
+#include "gpio_midi_core.h"
 
-    struct sockaddr_in sockaddr = {
-        .sin_family         = AF_INET,
-        .sin_port           = htons(common->server_port),
-        .sin_addr.s_addr    = htonl(INADDR_LOOPBACK),
-    };
+// Line request, value reads and writes, and edge waits: the GPIO chardev or the simulated matrix
+struct gpio_backend {
+    action_code_t   (*open)(common_t * common);
+    int             (*values)(common_t * common, unsigned long request, struct gpio_v2_line_values * values);
+    void            (*drain)(common_t * common);
+    int             (*wait)(common_t * common, int timeout);
+    void            (*adopt)(common_t * common, const config_t * config);
+};
 
-    const char * const server_ip = common->server_ip;
+uint8_t get_velocity(const config_t * const restrict config, const uint64_t time) {
+    const velocity_point_t * const restrict curve = config->velocity_curve;
+    const uint8_t count = config->velocity_points;
+    const uint32_t us = time / 1000;
 
-    if (server_ip != NULL) {
-        inet_pton(AF_INET, server_ip, &sockaddr.sin_addr);
+    if (us <= curve[0].time) {
+        return curve[0].velocity;
     }
 
-    int gpio_timeout = 1;
-    uint8_t keys[37] = { [0 ... 36] = 0 };
+    for (uint8_t i = 1; i < count; i++) {
+        const velocity_point_t * const restrict a = curve + i - 1;
+        const velocity_point_t * const restrict b = curve + i;
 
-    while (1) {
-        int result = connect(server_fd, (struct sockaddr *)&sockaddr, sizeof(sockaddr));
+        if (us < b->time) {
+            const int velocity = a->velocity + ((int)b->velocity - a->velocity) *
+                (int64_t)(us - a->time) / (b->time - a->time);
 
-        if (UNLIKELY(result < 0)) {
-            sleep(CONFIG_CONNECT_TIMEOUT);
-            continue;
+            return (velocity < 1 ? 1 : velocity);
         }
+    }
 
-        while (1) {
-            static uint8_t key_hash[5][8] = {
-                [2][7] = 0,
-                [2][2] = 1,
-                [2][6] = 2,
-                [2][0] = 3,
-                [2][4] = 4,
-                [2][1] = 5,
-                [2][3] = 6,
-                [2][5] = 7,
-                [1][7] = 8,
-                [1][2] = 9,
-                [1][6] = 10,
-                [1][0] = 11,
-                [1][4] = 12,
-                [1][1] = 13,
-                [1][3] = 14,
-                [1][5] = 15,
-                [3][7] = 16,
-                [3][2] = 17,
-                [3][6] = 18,
-                [3][0] = 19,
-                [3][4] = 20,
-                [3][1] = 21,
-                [3][3] = 22,
-                [3][5] = 23,
-                [4][7] = 24,
-                [4][2] = 25,
-                [4][6] = 26,
-                [4][0] = 27,
-                [4][4] = 28,
-                [4][1] = 29,
-                [4][3] = 30,
-                [4][5] = 31,
-                [0][7] = 32,
-                [0][2] = 33,
-                [0][6] = 34,
-                [0][0] = 35,
-                [0][4] = 36,
-            };
-
-            uint8_t midi_event_count = 0;
-            midi_event_t midi_events[CONFIG_MAX_MIDI_EVENTS];
-
-            for (uint8_t i = 0; i < 5; i++) {
-                struct gpiohandle_data data = { .values[0 ... 4] = 0 };
-                data.values[i] = 1;
+    return curve[count - 1].velocity;
+}
 
-                result = ioctl(common->out_fd, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &data);
+action_code_t write_stats(const common_t * const restrict common) {
+    char tmp_path[256];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", common->stats_path);
 
-                if (UNLIKELY(result < 0)) {
-                    return IOCTL_GPIO_SET_ACTION_CODE;
-                }
+    const int stats_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP);
 
-                result = ioctl(common->in_fd, GPIOHANDLE_GET_LINE_VALUES_IOCTL, &data);
+    if (UNLIKELY(stats_fd < 0)) {
+        return OPEN_STATS_FILE_ACTION_CODE;
+    }
 
-                if (UNLIKELY(result < 0)) {
-                    return IOCTL_GPIO_GET_ACTION_CODE;
-                }
+    const hist_t * const restrict late = &common->scan_late;
+
+    dprintf(stats_fd, "Scan period: %llu ns\n", (unsigned long long)common->scan_period);
+    dprintf(stats_fd, "Timed scans: %llu, overruns: %llu\n",
+        (unsigned long long)late->count, (unsigned long long)common->scan_overruns);
+    dprintf(stats_fd, "Lateness: avg %llu ns, p50 %llu ns, p99 %llu ns, p999 %llu ns, max %llu ns\n",
+        (unsigned long long)(late->count > 0 ? late->sum / late->count : 0),
+        (unsigned long long)hist_percentile(late, 5000),
+        (unsigned long long)hist_percentile(late, 9900),
+        (unsigned long long)hist_percentile(late, 9990),
+        (unsigned long long)late->max);
+
+    const hist_t * const restrict interval = &common->scan_interval;
+
+    dprintf(stats_fd, "Timing resolution: p50 %llu ns, p99 %llu ns, max %llu ns over %llu scans\n",
+        (unsigned long long)hist_percentile(interval, 5000),
+        (unsigned long long)hist_percentile(interval, 9900),
+        (unsigned long long)interval->max,
+        (unsigned long long)interval->count);
+
+#ifdef LOCAL
+    write_hist(stats_fd, "Scan to seq", &common->total_latency);
+    write_hist(stats_fd, "Seq write", &common->seq_latency);
+#endif
 
-                for (uint8_t j = 0; j < 8; j++) {
-                    const uint8_t key = key_hash[i][j];
-                    const uint8_t value = data.values[j];
+    for (uint32_t i = 0; i < CONFIG_HIST_BUCKETS; i++) {
+        if (late->buckets[i] > 0) {
+            dprintf(stats_fd, "%12llu ns: %llu\n",
+                (unsigned long long)hist_value(i), (unsigned long long)late->buckets[i]);
+        }
+    }
 
-                    if (keys[key] != value) {
-                        keys[key] = value;
+    close(stats_fd);
+    rename(tmp_path, common->stats_path);
 
-                        midi_events[midi_event_count++] = (const midi_event_t) {
-                            .key        = key + 3 * 12, // 3 octave offset
-                            .velocity   = value * 100
-                        };
-                    }
-                }
-            }
+    return SUCCESS_ACTION_CODE;
+}
 
-            if (midi_event_count > 0) {
-                const int events_size = midi_event_count * sizeof(midi_events[0]);
-                result = write(server_fd, midi_events, events_size);
+static inline int gpio_ioctl(common_t * const restrict common, const unsigned long request,
+                             struct gpio_v2_line_values * const restrict values) {
+    telemetry_t * const restrict telemetry = common->telemetry;
+    const uint64_t start = get_time_ns();
+    const int result = common->gpio->values(common, request, values);
 
-                if (result != events_size) {
-                    return SEND_EVENTS_ACTION_CODE;
-                } else {
-                    gpio_timeout = 1;
-                }
-            } else {
-                usleep(gpio_timeout);
+    hist_add(&telemetry->ioctl_time, get_time_ns() - start);
+    counter_add(&telemetry->gpio_ioctls, 1);
 
-                if (gpio_timeout < CONFIG_MAX_GPIO_TIMEOUT) {
-                    gpio_timeout <<= 1;
-                }
-            }
-        }
-    }
+    return result;
 }
 
-action_code_t init_gpio(common_t * const restrict common) {
-    const int chip_fd = open(GPIO_CHIP, 0);
-
-    if (UNLIKELY(chip_fd < 0)) {
-        return OPEN_GPIO_CHIP_ACTION_CODE;
-    } else {
-        common->chip_fd = chip_fd;
+action_code_t gpio_set_rows(common_t * const restrict common, const uint64_t rows) {
+    if (rows == common->rows) {
+        return SUCCESS_ACTION_CODE;
     }
 
-    struct gpiohandle_request out_request = {
-        .lineoffsets    = { 7, 8, 15, 17, 27 },
-        .flags          = GPIOHANDLE_REQUEST_OUTPUT,
-        .default_values = { 0, 0, 0, 0, 0 },
-        .consumer_label = APP_NAME,
-        .lines          = 5,
+    struct gpio_v2_line_values values = {
+        .bits   = rows,
+        .mask   = common->rows_mask,
     };
 
-    int result = ioctl(chip_fd, GPIO_GET_LINEHANDLE_IOCTL, &out_request);
+    const int result = gpio_ioctl(common, GPIO_V2_LINE_SET_VALUES_IOCTL, &values);
 
     if (UNLIKELY(result < 0)) {
-        return IOCTL_GPIO_OUT_ACTION_CODE;
-    } else {
-        common->out_fd = out_request.fd;
+        return IOCTL_GPIO_SET_ACTION_CODE;
     }
 
-    struct gpiohandle_request in_request = {
-        .lineoffsets    = { 11, 9, 25, 10, 24, 23, 22, 18 },
-        .flags          = GPIOHANDLE_REQUEST_INPUT,
-        .default_values = { 0, 0, 0, 0, 0, 0, 0, 0 },
-        .consumer_label = APP_NAME,
-        .lines          = 8,
+    common->rows = rows;
+    return SUCCESS_ACTION_CODE;
+}
+
+action_code_t gpio_get_columns(common_t * const restrict common, uint32_t * const restrict columns) {
+    struct gpio_v2_line_values values = {
+        .bits   = 0,
+        .mask   = common->columns_mask,
     };
 
-    result = ioctl(chip_fd, GPIO_GET_LINEHANDLE_IOCTL, &in_request);
+    const int result = gpio_ioctl(common, GPIO_V2_LINE_GET_VALUES_IOCTL, &values);
 
     if (UNLIKELY(result < 0)) {
-        return IOCTL_GPIO_IN_ACTION_CODE;
-    } else {
-        common->in_fd = in_request.fd;
+        return IOCTL_GPIO_GET_ACTION_CODE;
     }
 
-    close(chip_fd);
-    common->chip_fd = -1;
-
-    return main_loop(common);
+    *columns = values.bits >> common->geometry.rows;
+    return SUCCESS_ACTION_CODE;
 }
 
-action_code_t quit_proc(const common_t * const restrict common) {
-    const int pid_fd = open(common->pid_path, O_RDONLY);
+static inline uint8_t matrix_busy(const common_t * const restrict common) {
+    uint64_t locked = 0;
 
-    if (UNLIKELY(pid_fd < 0)) {
-        return OPEN_PID_FILE_ACTION_CODE;
+    for (uint32_t i = 0; i < common->matrix_words; i++) {
+        locked |= common->locked[i];
     }
 
-    pid_t pid;
-    const int result = read(pid_fd, &pid, sizeof(pid));
-    close(pid_fd);
+    return (common->columns != 0 || locked != 0);
+}
+
+// First contact closed, second not yet: the key is travelling and needs full rate scans
+static inline uint8_t matrix_in_flight(const common_t * const restrict common) {
+    uint64_t in_flight = 0;
 
-    if (UNLIKELY(result != sizeof(pid))) {
-        return READ_PID_FILE_ACTION_CODE;
+    if (!common->dual_contact) {
+        return 0;
     }
 
-    kill(pid, SIGTERM);
-    return SUCCESS_ACTION_CODE;
+    for (uint32_t i = 0; i < common->matrix_words; i++) {
+        in_flight |= common->matrix[i] & common->config->first_mask[i] & ~common->sounding[i];
+    }
+
+    return (in_flight != 0);
 }
 
-action_code_t view_log(const common_t * const restrict common) {
-    const int log_fd = open(common->log_path, O_RDONLY);
+// Inlined once per stride: the common 8 column wiring gets constant shifts and rows never straddle words
+static inline __attribute__((always_inline))
+action_code_t scan_rows(common_t * const restrict common, uint64_t * const restrict raw,
+                        uint64_t * const restrict row_time, uint32_t * const restrict columns, const uint32_t stride) {
+    for (uint8_t i = 0; i < common->matrix_rows; i++) {
+        uint32_t values;
+        action_code_t action_code = gpio_set_rows(common, common->row_bits[i]);
 
-    if (UNLIKELY(log_fd < 0)) {
-        return OPEN_LOG_FILE_ACTION_CODE;
-    }
+        if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+            return action_code;
+        }
 
-    action_code_t action_code;
-    const int result = read(log_fd, &action_code, sizeof(action_code));
-    close(log_fd);
+        action_code = gpio_get_columns(common, &values);
+
+        if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+            return action_code;
+        }
 
-    if (UNLIKELY(result != sizeof(action_code))) {
-        return READ_LOG_FILE_ACTION_CODE;
+        const uint32_t bit = i * stride;
+
+        row_time[i] = get_time_ns();
+        raw[bit / 64] |= (uint64_t)values << (bit % 64);
+
+        if (64 % stride != 0 && bit % 64 + stride > 64) {
+            raw[bit / 64 + 1] |= (uint64_t)values >> (64 - bit % 64);
+        }
+
+        *columns |= values;
     }
 
-    printf("Log: %d\n", action_code);
     return SUCCESS_ACTION_CODE;
 }
 
-action_code_t destroy(const action_code_t action_code) {
-    unlink(common.pid_path);
+action_code_t scan_matrix(common_t * const restrict common, midi_event_t * const restrict midi_events,
+                          uint8_t * const restrict midi_event_count, uint8_t full) {
+    const config_t * const restrict config = common->config;
+    action_code_t action_code;
+    uint32_t columns = 0;
+    uint64_t raw[MATRIX_WORDS] = { [0 ... MATRIX_WORDS - 1] = 0 };
+    uint64_t row_time[MAX_SCAN_ROWS];
 
-    if (common.in_fd >= 0) {
-        close(common.in_fd);
-    }
+    // With no keys held one read with every row driven tells whether anything is pressed at all
+    if (common->columns == 0 && !full) {
+        action_code = gpio_set_rows(common, common->rows_mask);
 
-    if (common.out_fd >= 0) {
-        close(common.out_fd);
-    }
+        if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+            return action_code;
+        }
 
-    if (common.chip_fd >= 0) {
-        close(common.chip_fd);
+        action_code = gpio_get_columns(common, &columns);
+
+        if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+            return action_code;
+        }
+    } else {
+        full = 1;
     }
 
-    if (common.server_fd >= 0) {
-        close(common.server_fd);
+    if (full || columns != 0) {
+        const uint32_t stride = common->matrix_columns;
+        columns = 0;
+
+        if (stride == SCAN_FAST_COLUMNS) {
+            action_code = scan_rows(common, raw, row_time, &columns, SCAN_FAST_COLUMNS);
+        } else {
+            action_code = scan_rows(common, raw, row_time, &columns, stride);
+        }
+
+        if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+            return action_code;
+        }
     }
 
-    const int log_fd = open(common.log_path,
-        O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP);
+    const uint64_t now = get_time_ns();
+    const uint64_t debounce_time = config->debounce_time;
+
+    common->scan_time = now;
+    counter_add(&common->telemetry->scans, 1);
+    uint8_t count = 0;
 
-    if (UNLIKELY(log_fd < 0)) {
-        return OPEN_LOG_FILE_ACTION_CODE;
+    if (common->last_scan != 0) {
+        hist_add(&common->scan_interval, now - common->last_scan);
     }
 
-    const int result = write(log_fd, &action_code, sizeof(action_code));
-    close(log_fd);
+    common->last_scan = now;
 
-    if (UNLIKELY(result != sizeof(action_code))) {
-        return WRITE_LOG_FILE_ACTION_CODE;
+    for (uint32_t i = 0; i < common->matrix_words; i++) {
+        uint64_t locked = common->locked[i];
+
+        for (uint64_t bits = locked; bits != 0; bits &= bits - 1) {
+            const uint32_t bit = __builtin_ctzll(bits);
+
+            if (now >= common->lock_until[i * 64 + bit]) {
+                locked &= ~(1ull << bit);
+            }
+        }
+
+        const uint64_t matrix = common->matrix[i];
+        const uint64_t changed = (raw[i] ^ matrix) & config->matrix_mask[i] & ~locked;
+
+        common->matrix[i] = matrix ^ changed;
+        common->locked[i] = locked | (debounce_time != 0 ? changed : 0);
+
+        for (uint64_t bits = changed; bits != 0; bits &= bits - 1) {
+            const uint32_t bit = __builtin_ctzll(bits);
+            const uint32_t index = i * 64 + bit;
+            const scan_key_t * const restrict scan_key = config->scan_table + index;
+
+            const uint8_t closed = (raw[i] >> bit) & 1;
+            common->lock_until[index] = now + debounce_time;
+
+            const uint32_t key = scan_key->key;
+            const uint64_t key_bit = 1ull << (key % 64);
+            uint64_t * const restrict sounding = common->sounding + key / 64;
+
+            if (!common->dual_contact) {
+                midi_events[count++] = (const midi_event_t) {
+                    .key        = scan_key->note,
+                    .velocity   = closed * 100,
+                };
+            } else if (!scan_key->second) {
+                if (closed) {
+                    common->contact_time[key] = row_time[scan_key->row];
+                } else if (*sounding & key_bit) {
+                    *sounding &= ~key_bit;
+
+                    midi_events[count++] = (const midi_event_t) {
+                        .key        = scan_key->note,
+                        .velocity   = 0,
+                    };
+                }
+            } else if (closed && !(*sounding & key_bit) && (common->matrix[key / 64] & key_bit)) {
+                const uint64_t time = row_time[scan_key->row] - common->contact_time[key];
+                *sounding |= key_bit;
+
+                midi_events[count++] = (const midi_event_t) {
+                    .key        = scan_key->note,
+                    .velocity   = get_velocity(config, time),
+                };
+            }
+        }
     }
 
+    *midi_event_count = count;
+    common->columns = columns;
     return SUCCESS_ACTION_CODE;
 }
 
-void sig_proc(const int code) {
-    switch (code) {
-        case SIGSEGV: return (void)destroy(SIGSEGV_ACTION_CODE);
-        case SIGTERM: return (void)destroy(SIGTERM_ACTION_CODE);
+static inline void track_notes(uint8_t * const restrict notes, const midi_event_t * const restrict midi_events,
+                               const uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t key = midi_events[i].key % MIDI_NOTES;
+        const uint8_t bit = 1 << (key % 8);
+
+        notes[key / 8] = (midi_events[i].velocity > 0 ? notes[key / 8] | bit : notes[key / 8] & ~bit);
+    }
+}
+
+#ifdef LOCAL
+// Local builds are their own sequencer client, events go to whoever subscribes to its port
+action_code_t open_seq(common_t * const restrict common) {
+    const int seq_fd = open(common->seq_path, O_WRONLY);
+
+    if (UNLIKELY(seq_fd < 0)) {
+        return OPEN_SND_SEQ_ACTION_CODE;
+    } else {
+        common->seq_fd = seq_fd;
+    }
+
+    const action_code_t action_code = register_seq(common);
+
+    if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+        return action_code;
     }
+
+    return connect_seq(common, NULL, &common->seq_connect);
 }
 
-action_code_t init(common_t * const restrict common) {
-    pid_t pid = fork();
+// The sender writes each scan's events to the sequencer itself, no socket or second process in between.
+// sent is how many of the events, from the first, were written whole
+action_code_t send_events(common_t * const restrict common, const midi_event_t * const restrict midi_events,
+                          const uint8_t count, const uint64_t scan_time, uint8_t * const restrict sent) {
+    struct snd_seq_event seq_events[CONFIG_MAX_MIDI_EVENTS];
+
+    counter_add(&common->telemetry->events, count);
+
+    for (uint8_t i = 0; i < count; i++) {
+        seq_events[i] = (const struct snd_seq_event) {
+            .type               = SNDRV_SEQ_EVENT_NOTEON + (midi_events[i].velocity == 0),
+            .flags              = SNDRV_SEQ_EVENT_LENGTH_FIXED,
+            .queue              = SNDRV_SEQ_QUEUE_DIRECT,
+            .source             = common->seq_port,
+            .dest.client        = SNDRV_SEQ_ADDRESS_SUBSCRIBERS,
+            .dest.port          = SNDRV_SEQ_ADDRESS_UNKNOWN,
+            .data.note.channel  = common->channel,
+            .data.note.note     = midi_events[i].key,
+            .data.note.velocity = midi_events[i].velocity,
+        };
+    }
+
+    const int seq_events_size = count * sizeof(struct snd_seq_event);
+    const uint64_t write_time = get_time_ns();
+    const int result = write(common->seq_fd, seq_events, seq_events_size);
+    const uint64_t done_time = get_time_ns();
+
+    hist_add_n(&common->seq_latency, done_time - write_time, count);
+    hist_add_n(&common->total_latency, done_time - scan_time, count);
 
-    if (pid == SUCCESS_ACTION_CODE) {
-        signal(SIGSEGV, sig_proc);
-        signal(SIGINT, sig_proc);
-        signal(SIGPIPE, SIG_IGN);
-        signal(SIGHUP, SIG_IGN);
+    *sent = (result > 0 ? result / sizeof(struct snd_seq_event) : 0);
+    track_notes(common->delivered, midi_events, *sent);
 
-        close(STDERR_FILENO);
-        close(STDOUT_FILENO);
-        close(STDIN_FILENO);
+    if (UNLIKELY(result != seq_events_size)) {
+        counter_add(&common->telemetry->send_failures, 1);
+        return SEND_EVENTS_ACTION_CODE;
+    }
 
-        return destroy(init_gpio(common));
-    } else if (pid > 0) {
-        const int pid_fd = open(common->pid_path,
-            O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP);
+    return SUCCESS_ACTION_CODE;
+}
+#else
+// Delivered notes are what the server was last told, a reconnect resyncs it against the held ones. sent is
+// how many of the events, from the first, reached the server whole. A frame cut short by a failed write
+// never completes, the server drops it with the connection, so its events count as not sent
+action_code_t send_events(common_t * const restrict common, const midi_event_t * const restrict midi_events,
+                          const uint8_t count, const uint64_t scan_time, uint8_t * const restrict sent) {
+    counter_add(&common->telemetry->events, count);
+    *sent = 0;
+
+    if (!common->udp) {
+        const uint16_t features = common->features;
+        const int events_size = count * sizeof(midi_event_t);
+
+        // Bare events stand on their own, every one written whole was received
+        if (!(features & (MIDI_FEATURE_BATCH | MIDI_FEATURE_STAMP))) {
+            const int result = write(common->server_fd, midi_events, events_size);
+
+            *sent = (result > 0 ? result / sizeof(midi_event_t) : 0);
+            track_notes(common->delivered, midi_events, *sent);
+
+            if (UNLIKELY(result != events_size)) {
+                counter_add(&common->telemetry->send_failures, 1);
+                return SEND_EVENTS_ACTION_CODE;
+            }
 
-        if (UNLIKELY(pid_fd < 0)) {
-            return OPEN_PID_FILE_ACTION_CODE;
+            return SUCCESS_ACTION_CODE;
         }
 
-        const int result = write(pid_fd, &pid, sizeof(pid));
-        close(pid_fd);
+        struct {
+            midi_batch_t    batch;
+            midi_event_t    events[MATRIX_BITS];
+        } PACKED message = {
+            .batch.frame.type   = (features & MIDI_FEATURE_BATCH ? MIDI_FRAME_BATCH : MIDI_FRAME_STAMP),
+            .batch.frame.size   = htons(sizeof(midi_batch_t) - sizeof(midi_frame_t) +
+                                        (features & MIDI_FEATURE_BATCH ? events_size : 0)),
+            .batch.scan_time    = htobe64(scan_time),
+            .batch.send_time    = htobe64(get_time_ns()),
+        };
+
+        // Header and events share one write so they arrive in one segment
+        const int message_size = sizeof(midi_batch_t) + events_size;
+        memcpy(message.events, midi_events, events_size);
+
+        const int result = write(common->server_fd, &message, message_size);
 
-        if (UNLIKELY(result != sizeof(pid))) {
-            kill(pid, SIGTERM);
-            return WRITE_PID_FILE_ACTION_CODE;
+        if (UNLIKELY(result != message_size)) {
+            counter_add(&common->telemetry->send_failures, 1);
+            return SEND_EVENTS_ACTION_CODE;
         }
 
+        *sent = count;
+        track_notes(common->delivered, midi_events, count);
         return SUCCESS_ACTION_CODE;
     }
 
-    return FORK_ACTION_CODE;
-}
+    midi_datagram_t * const restrict datagram = (midi_datagram_t *)common->datagram;
+    const uint8_t journal = datagram->count;
 
-action_code_t test(common_t * const restrict common, const uint8_t key) {
-    const int server_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    memmove(datagram->events, datagram->events + datagram->journal, journal * sizeof(midi_event_t));
+    memcpy(datagram->events + journal, midi_events, count * sizeof(midi_event_t));
 
-    if (UNLIKELY(server_fd < 0)) {
-        return CREATE_SERVER_SOCKET_ACTION_CODE;
-    }
+    common->datagram_size = sizeof(midi_datagram_t) + (journal + count) * sizeof(midi_event_t);
 
-    struct sockaddr_in sockaddr = {
-        .sin_family         = AF_INET,
-        .sin_port           = htons(common->server_port),
-        .sin_addr.s_addr    = htonl(INADDR_LOOPBACK),
-    };
+    datagram->frame.type = MIDI_FRAME_DATAGRAM;
+    datagram->frame.size = htons(common->datagram_size - sizeof(midi_frame_t));
+    datagram->scan_time = htobe64(scan_time);
+    datagram->session = htonl(common->session);
+    datagram->sequence = htonl(++common->sequence);
+    datagram->count = count;
+    datagram->journal = journal;
 
-    const char * const server_ip = common->server_ip;
+    track_notes(datagram->notes, midi_events, count);
 
-    if (server_ip != NULL) {
-        inet_pton(AF_INET, server_ip, &sockaddr.sin_addr);
+    const uint64_t now = get_time_ns();
+    datagram->send_time = htobe64(now);
+
+    // Lost datagrams are what the journal and the resend are for. One the socket refuses is queued again
+    // instead, so it must not show up as the next one's journal either
+    if (UNLIKELY(write(common->server_fd, datagram, common->datagram_size) != (int)common->datagram_size)) {
+        counter_add(&common->telemetry->send_failures, 1);
+        datagram->count = 0;
+        return SEND_EVENTS_ACTION_CODE;
     }
 
-    int result = connect(server_fd, (struct sockaddr *)&sockaddr, sizeof(sockaddr));
+    *sent = count;
+    track_notes(common->delivered, midi_events, count);
+    common->resend_at = now + CONFIG_UDP_RESEND_TIME * 1000ull;
+    return SUCCESS_ACTION_CODE;
+}
+#endif
+
+// The last datagram goes out twice so a lone loss of it is still recovered
+void resend_datagram(common_t * const restrict common) {
+    common->resend_at = 0;
+    write(common->server_fd, common->datagram, common->datagram_size);
+}
 
-    if (UNLIKELY(result < 0)) {
-        return CONNECT_SERVER_ACTION_CODE;
+// A link that is not up wakes the idle wait for its next reconnect or handshake step
+static inline int idle_timeout(const common_t * const restrict common, const int timeout) {
+    const uint64_t wake_at = (common->link == LINK_UP ? common->resend_at : common->link_time);
+
+    if (wake_at == 0) {
+        return timeout;
     }
 
-    midi_event_t event = {
-        .key        = key,
-        .velocity   = 100,
+    const uint64_t now = get_time_ns();
+    const int wake = (wake_at > now ? (wake_at - now) / 1000 : 0);
+
+    return (timeout < 0 || wake < timeout ? wake : timeout);
+}
+
+void scan_sleep(common_t * const restrict common, uint64_t * const restrict deadline) {
+    const uint64_t period = common->scan_period;
+    uint64_t next = *deadline + period;
+
+    const struct timespec timespec = {
+        .tv_sec     = next / 1000000000,
+        .tv_nsec    = next % 1000000000,
     };
 
-    result = write(server_fd, &event, sizeof(event));
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &timespec, NULL) == EINTR);
 
-    if (UNLIKELY(result != sizeof(event))) {
-        close(server_fd);
-        return SEND_EVENTS_ACTION_CODE;
+    const uint64_t now = get_time_ns();
+    const uint64_t late = now - next;
+
+    hist_add(&common->scan_late, late);
+
+    if (UNLIKELY(late >= period)) {
+        common->scan_overruns++;
+        next = now;
     }
 
-    event.velocity = 0;
-    sleep(CONFIG_TEST_KEY_TIMEOUT);
+    *deadline = next;
+}
 
-    result = write(server_fd, &event, sizeof(event));
-    close(server_fd);
+// Events scanned while the link is down wait in a ring, once it overflows only the held notes
+// survive and the resync restores them
+void queue_events(common_t * const restrict common, const midi_event_t * const restrict midi_events,
+                  const uint32_t count, const uint64_t scan_time) {
+    telemetry_t * const restrict telemetry = common->telemetry;
+    const uint32_t used = common->queue_tail - common->queue_head;
 
-    if (UNLIKELY(result != sizeof(event))) {
-        return SEND_EVENTS_ACTION_CODE;
+    if (common->queue_overflow) {
+        return;
     }
 
-    return SUCCESS_ACTION_CODE;
+    if (UNLIKELY(used + count > CONFIG_MAX_QUEUE_EVENTS)) {
+        common->queue_overflow = 1;
+        common->queue_head = common->queue_tail;
+        counter_add(&telemetry->queue_overflows, 1);
+        return;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        common->queue[common->queue_tail++ % CONFIG_MAX_QUEUE_EVENTS] = (const ring_entry_t) {
+            .scan_time  = scan_time,
+            .event      = midi_events[i],
+        };
+    }
+
+    if (used + count > counter_get(&telemetry->queue_high)) {
+        counter_set(&telemetry->queue_high, used + count);
+    }
 }
 
-uint8_t get_key(const char * const restrict arg) {
-    uint8_t key = 0;
+// Whatever the server was told may still sound there, the resync after the reconnect releases it
+void link_down(common_t * const restrict common) {
+    const uint64_t now = get_time_ns();
 
-    switch (arg[0]) {
-        case 'C': key = 0; break;
-        case 'D': key = 2; break;
-        case 'E': key = 4; break;
-        case 'F': key = 5; break;
-        case 'G': key = 7; break;
-        case 'A': key = 9; break;
-        case 'B': key = 11; break;
+    if (common->server_fd >= 0) {
+        close(common->server_fd);
+        common->server_fd = -1;
     }
 
-    char next_c = arg[2];
+    if (common->link == LINK_UP) {
+        common->down_time = now;
+        common->backoff = 0;
+    }
 
-    switch (arg[1]) {
-        case '#': key++; break;
-        case 'b': key--; break;
-        default: next_c = arg[1];
+    for (uint32_t i = 0; i < MIDI_NOTES / 8; i++) {
+        common->unsure[i] |= common->delivered[i];
     }
 
-    return key + (next_c - '0') * 12;
+    common->backoff = (common->backoff == 0 ? CONFIG_RECONNECT_MIN :
+        common->backoff * 2 < CONFIG_RECONNECT_MAX ? common->backoff * 2 : CONFIG_RECONNECT_MAX);
+
+    common->link = LINK_DOWN;
+    common->link_time = now + common->backoff;
+    common->resend_at = 0;
+    common->rx_fill = 0;
 }
 
-typedef enum {
-    STANDARD_PROCESS,
-    VIEW_LOG_PROCESS,
-    QUIT_PROCESS,
-    TEST_PROCESS,
-} process_t;
+// Queued events go out first, a batch per scan with its own scan time, then one batch releases what
+// the server may still hold and starts what it never heard about
+void link_up(common_t * const restrict common, const uint16_t features) {
+    telemetry_t * const restrict telemetry = common->telemetry;
+    midi_event_t midi_events[MIDI_NOTES];
 
-int main(const int argc, char * const argv[]) {
-    process_t process = STANDARD_PROCESS;
-    uint8_t test_key = 0;
+    common->features = features;
+    common->link = LINK_UP;
+    common->backoff = 0;
 
-    while (1) {
-        static const struct option options[] = {
-            {
-                .name       = "server",
-                .has_arg    = required_argument,
-                .flag       = NULL,
-                .val        = 's',
-            },
-            {
-                .name       = "log-file",
-                .has_arg    = required_argument,
-                .flag       = NULL,
-                .val        = 'l',
-            },
-            {
-                .name       = "pid-file",
-                .has_arg    = required_argument,
-                .flag       = NULL,
-                .val        = 'p',
-            },
-            {
-                .name       = "quit",
-                .has_arg    = no_argument,
-                .flag       = NULL,
-                .val        = 'q',
-            },
-            {
-                .name       = "view-log",
-                .has_arg    = no_argument,
-                .flag       = NULL,
-                .val        = 'v',
-            },
-            {
-                .name       = "test",
-                .has_arg    = required_argument,
-                .flag       = NULL,
-                .val        = 't',
-            },
-            {
-                .name       = "help",
-                .has_arg    = no_argument,
-                .flag       = NULL,
-                .val        = 'h',
-            },
-            {   NULL, 0, NULL, 0    }
-        };
+    hist_add(&telemetry->reconnect_time, get_time_ns() - common->down_time);
 
-        const int opt = getopt_long(argc, argv, "s:l:p:qvt:h", options, NULL);
+    while (!common->queue_overflow && common->queue_head != common->queue_tail) {
+        const uint64_t scan_time = common->queue[common->queue_head % CONFIG_MAX_QUEUE_EVENTS].scan_time;
+        uint32_t count = 0;
 
-        if (UNLIKELY(opt < 0)) {
-            break;
+        while (common->queue_head + count != common->queue_tail && count < MIDI_NOTES &&
+               common->queue[(common->queue_head + count) % CONFIG_MAX_QUEUE_EVENTS].scan_time == scan_time) {
+            midi_events[count] = common->queue[(common->queue_head + count) % CONFIG_MAX_QUEUE_EVENTS].event;
+            count++;
         }
 
-        switch (opt) {
-            case 's': {
-                char * restrict port = strchr(optarg, ':');
+        uint8_t sent;
 
-                if (port != NULL) {
-                    *port++ = '\0';
-                    common.server_port = atoi(port);
-                }
+        if (UNLIKELY(send_events(common, midi_events, count, scan_time, &sent) != SUCCESS_ACTION_CODE)) {
+            common->queue_head += sent;
+            link_down(common);
+            return;
+        }
 
-                common.server_ip = optarg;
-            } break;
-            case 'l': common.log_path = optarg; break;
-            case 'p': common.pid_path = optarg; break;
-            case 'v': process = VIEW_LOG_PROCESS; break;
-            case 'q': process = QUIT_PROCESS; break;
-            case 't': {
-                process = TEST_PROCESS;
-                test_key = get_key(optarg);
-            } break;
-            case '?': case 'h': {
-                static const char help[] =
-                    "GPIO-MIDI RPI client v0.0.1\n"
-                    "-s, --server\t:\tServer IP and port (127.0.0.1:9001)\n"
-                    "-l, --log-file\t:\tLog file (" APP_NAME ".log)\n"
-                    "-p, --pid-file\t:\tPid file (" APP_NAME ".pid)\n"
-                    "-q, --quit\t:\tQuit daemod\n"
-                    "-v, --view-log\t:\tView log action code\n"
-                    "-t, --test\t:\tPlay test note (-t C#3 or -t Db4 or -t E5)\n"
-                    "-h, --help\t:\tPrint this help info\n";
+        common->queue_head += count;
+    }
 
-                write(STDOUT_FILENO, help, sizeof(help) - 1);
-            } return SUCCESS_ACTION_CODE;
+    common->queue_head = common->queue_tail = 0;
+    common->queue_overflow = 0;
+
+    uint32_t count = 0;
+
+    for (uint32_t key = 0; key < MIDI_NOTES; key++) {
+        const uint8_t bit = 1 << (key % 8);
+        const uint8_t held = common->held[key / 8] & bit;
+        const uint8_t delivered = common->delivered[key / 8] & bit;
+
+        if (!held && (delivered || (common->unsure[key / 8] & bit))) {
+            midi_events[count++] = (const midi_event_t) {
+                .key        = key,
+                .velocity   = 0,
+            };
+        } else if (held && !delivered) {
+            midi_events[count++] = (const midi_event_t) {
+                .key        = key,
+                .velocity   = common->velocities[key],
+            };
         }
     }
 
-    switch (process) {
-        case STANDARD_PROCESS: return init(&common);
-        case VIEW_LOG_PROCESS: return view_log(&common);
-        case QUIT_PROCESS: return quit_proc(&common);
-        case TEST_PROCESS: return test(&common, test_key);
+    memset(common->unsure, 0, sizeof(common->unsure));
+
+    if (count == 0) {
+        return;
+    }
+
+    counter_add(&telemetry->resyncs, 1);
+
+    uint8_t sent;
+
+    if (UNLIKELY(send_events(common, midi_events, count, common->scan_time, &sent) != SUCCESS_ACTION_CODE)) {
+        link_down(common);
+    }
+}
+
+void send_hello(common_t * const restrict common) {
+    const midi_hello_t hello = {
+        .frame.type     = MIDI_FRAME_HELLO,
+        .frame.size     = htons(sizeof(midi_hello_t) - sizeof(midi_frame_t)),
+        .version        = MIDI_PROTOCOL_VERSION,
+        .channel        = common->channel,
+        .features       = htons(MIDI_FEATURES),
+        .device         = htonl(common->device),
+    };
+
+    if (UNLIKELY(write(common->server_fd, &hello, sizeof(hello)) != sizeof(hello))) {
+        link_down(common);
+        return;
+    }
+
+    common->link = LINK_HANDSHAKE;
+}
+
+// A server that stays silent through the handshake is taken for a legacy one and gets bare events. Over TCP
+// the hello waits for the server's greeting, a legacy server would play it as notes; one with no UDP socket
+// never sees a datagram
+void link_hello(common_t * const restrict common) {
+    counter_add(&common->telemetry->connects, 1);
+
+    common->link = LINK_GREETING;
+    common->link_time = get_time_ns() + CONFIG_CONNECT_TIMEOUT * 1000000000ull;
+
+    if (common->udp) {
+        send_hello(common);
+    }
+}
+
+// The socket stays non-blocking once connected, a write the network can't take drops the link
+// instead of stalling the scan
+void link_connect(common_t * const restrict common) {
+#ifdef LOCAL
+    // The sequencer stays open, a failed write is retried after the backoff with a resync
+    link_up(common, 0);
+#else
+    const int server_fd = (common->udp ?
+        socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP) :
+        socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP));
+
+    if (UNLIKELY(server_fd < 0)) {
+        link_down(common);
+        return;
+    } else {
+        common->server_fd = server_fd;
+    }
+
+    if (!common->udp) {
+        const int nodelay = 1;
+        const unsigned int user_timeout = CONFIG_CONNECT_TIMEOUT * 1000;
+
+        setsockopt(server_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        setsockopt(server_fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(user_timeout));
+    }
+
+    const int result = connect(server_fd, (struct sockaddr *)&common->server_addr, sizeof(common->server_addr));
+
+    if (result == 0) {
+        link_hello(common);
+    } else if (errno == EINPROGRESS) {
+        common->link = LINK_CONNECTING;
+        common->link_time = get_time_ns() + CONFIG_CONNECT_TIMEOUT * 1000000000ull;
+    } else {
+        link_down(common);
+    }
+#endif
+}
+
+// Answers clock pings so the server can put scan timestamps on its own clock, and takes the handshake welcome
+action_code_t read_server(common_t * const restrict common) {
+    uint8_t * const restrict buffer = common->rx_buffer;
+    const int result = recv(common->server_fd, buffer + common->rx_fill,
+        sizeof(common->rx_buffer) - common->rx_fill, MSG_DONTWAIT);
+
+    if (result <= 0) {
+        if (common->udp || (result < 0 && (errno == EAGAIN || errno == EINTR))) {
+            return SUCCESS_ACTION_CODE;
+        }
+
+        return READ_SERVER_ACTION_CODE;
+    }
+
+    const uint32_t size = (common->udp ? (uint32_t)result : common->rx_fill + result);
+    uint32_t offset = 0;
+
+    while (size - offset >= sizeof(midi_frame_t) && common->server_fd >= 0) {
+        const midi_frame_t * const restrict frame = (const midi_frame_t *)(buffer + offset);
+        const uint32_t frame_size = sizeof(midi_frame_t) + ntohs(frame->size);
+
+        if (UNLIKELY(frame_size > sizeof(common->rx_buffer))) {
+            return READ_SERVER_ACTION_CODE;
+        }
+
+        if (size - offset < frame_size) {
+            break;
+        }
+
+        if (frame->type == MIDI_FRAME_PING && frame_size == sizeof(midi_sync_t)) {
+            midi_sync_t pong = *(const midi_sync_t *)frame;
+
+            pong.frame.type = MIDI_FRAME_PONG;
+            pong.client_time = htobe64(get_time_ns());
+            write(common->server_fd, &pong, sizeof(pong));
+        } else if (frame->type == MIDI_FRAME_HELLO && frame_size == sizeof(midi_hello_t) &&
+                   common->link == LINK_GREETING) {
+            send_hello(common);
+        } else if (frame->type == MIDI_FRAME_WELCOME && frame_size == sizeof(midi_hello_t) &&
+                   common->link == LINK_HANDSHAKE) {
+            const midi_hello_t * const restrict welcome = (const midi_hello_t *)frame;
+
+            link_up(common, (welcome->version >= MIDI_PROTOCOL_VERSION ?
+                ntohs(welcome->features) & MIDI_FEATURES : 0));
+        }
+
+        offset += frame_size;
+    }
+
+    // Bringing the link up flushes the queue, a failed flush has already closed the socket
+    common->rx_fill = (common->udp || common->server_fd < 0 ? 0 : size - offset);
+    memmove(buffer, buffer + offset, common->rx_fill);
+
+    return SUCCESS_ACTION_CODE;
+}
+
+// Moves the link one step on, run every pass of the sender while it is not up and whenever the server socket wakes it
+void service_link(common_t * const restrict common) {
+    const uint64_t now = get_time_ns();
+
+    switch (common->link) {
+        case LINK_DOWN: {
+            if (now >= common->link_time) {
+                link_connect(common);
+            }
+        } break;
+        case LINK_CONNECTING: {
+            struct pollfd pollfd = {
+                .fd         = common->server_fd,
+                .events     = POLLOUT,
+            };
+
+            int error = 0;
+            socklen_t error_size = sizeof(error);
+
+            if (poll(&pollfd, 1, 0) <= 0) {
+                if (now >= common->link_time) {
+                    link_down(common);
+                }
+            } else if (getsockopt(common->server_fd, SOL_SOCKET, SO_ERROR, &error, &error_size) == 0 && error == 0) {
+                link_hello(common);
+            } else {
+                link_down(common);
+            }
+        } break;
+        case LINK_GREETING: case LINK_HANDSHAKE: case LINK_UP: {
+            if (read_server(common) != SUCCESS_ACTION_CODE) {
+                link_down(common);
+            } else if ((common->link == LINK_GREETING || common->link == LINK_HANDSHAKE) &&
+                       now >= common->link_time) {
+                link_up(common, 0);
+            }
+        } break;
+    }
+}
+
+action_code_t gpio_idle(common_t * const restrict common, const int timeout) {
+    action_code_t action_code = gpio_set_rows(common, common->rows_mask);
+
+    if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+        return action_code;
+    }
+
+    common->gpio->drain(common);
+
+    uint32_t columns;
+    action_code = gpio_get_columns(common, &columns);
+
+    if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+        return action_code;
+    }
+
+    if (columns != common->columns) {
+        return SUCCESS_ACTION_CODE; // edge raced with the drain above
+    }
+
+    const int result = common->gpio->wait(common, timeout);
+    common->last_scan = 0;
+
+    if (UNLIKELY(result < 0 && errno != EINTR)) {
+        return POLL_GPIO_EVENTS_ACTION_CODE;
+    }
+
+    return SUCCESS_ACTION_CODE;
+}
+
+// Events go out when the link is up and queue when it is not, a failed send queues the ones the server did
+// not get. Only bench_jitter() sets net_delay, it stands in for a slow network
+void deliver_events(common_t * const restrict common, const midi_event_t * const restrict midi_events,
+                    const uint8_t count, const uint64_t scan_time) {
+    uint8_t sent = 0;
+
+    track_notes(common->held, midi_events, count);
+
+    for (uint8_t i = 0; i < count; i++) {
+        if (midi_events[i].velocity > 0) {
+            common->velocities[midi_events[i].key % MIDI_NOTES] = midi_events[i].velocity;
+        }
+    }
+
+    if (common->link == LINK_UP) {
+        if (send_events(common, midi_events, count, scan_time, &sent) == SUCCESS_ACTION_CODE) {
+            if (UNLIKELY(common->net_delay != 0)) {
+                usleep(common->net_delay / 1000);
+            }
+
+            return;
+        }
+
+        link_down(common);
+    }
+
+    queue_events(common, midi_events + sent, count - sent, scan_time);
+}
+
+// Never blocks the scanner: a full ring drops the events and counts them, the sender is only
+// woken when it has said it is about to sleep
+static inline void ring_push(common_t * const restrict common, const midi_event_t * const restrict midi_events,
+                             const uint32_t count, const uint64_t scan_time) {
+    telemetry_t * const restrict telemetry = common->telemetry;
+    const uint32_t tail = common->ring_tail;
+    const uint32_t used = tail - __atomic_load_n(&common->ring_head, __ATOMIC_ACQUIRE);
+
+    if (UNLIKELY(used + count > CONFIG_RING_EVENTS)) {
+        counter_add(&telemetry->ring_overflows, count);
+        return;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        common->ring[(tail + i) % CONFIG_RING_EVENTS] = (const ring_entry_t) {
+            .scan_time  = scan_time,
+            .event      = midi_events[i],
+        };
+    }
+
+    if (used + count > counter_get(&telemetry->ring_high)) {
+        counter_set(&telemetry->ring_high, used + count);
+    }
+
+    // Pairs with the sender setting sender_waiting before it checks the ring a last time
+    __atomic_store_n(&common->ring_tail, tail + count, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&common->sender_waiting, __ATOMIC_SEQ_CST)) {
+        const uint64_t wake = 1;
+        write(common->wake_fd, &wake, sizeof(wake));
+    }
+}
+
+// Hands each run of events from one scan to the link as one batch, returns how many were taken
+uint32_t drain_ring(common_t * const restrict common) {
+    const uint32_t tail = __atomic_load_n(&common->ring_tail, __ATOMIC_ACQUIRE);
+    const uint32_t head = common->ring_head;
+    midi_event_t midi_events[MIDI_NOTES];
+
+    for (uint32_t index = head; index != tail;) {
+        const uint64_t scan_time = common->ring[index % CONFIG_RING_EVENTS].scan_time;
+        uint32_t count = 0;
+
+        while (index != tail && count < MIDI_NOTES && common->ring[index % CONFIG_RING_EVENTS].scan_time == scan_time) {
+            midi_events[count++] = common->ring[index++ % CONFIG_RING_EVENTS].event;
+        }
+
+        __atomic_store_n(&common->ring_head, index, __ATOMIC_RELEASE);
+        deliver_events(common, midi_events, count, scan_time);
+    }
+
+    return tail - head;
+}
+
+// Lines are requested as rows, columns, then second contact rows, scan rows follow the same order
+void build_matrix(common_t * const restrict common) {
+    const geometry_t * const restrict geometry = &common->geometry;
+    const uint32_t rows = geometry->rows;
+    const uint32_t columns = geometry->columns;
+    const uint32_t key_bits = rows * columns;
+
+    common->dual_contact = (geometry->second_rows == rows);
+    common->matrix_rows = (common->dual_contact ? 2 * rows : rows);
+    common->matrix_columns = columns;
+    common->matrix_words = (common->matrix_rows * columns + 63) / 64;
+    common->key_bits = key_bits;
+    common->columns_mask = ((1ull << columns) - 1) << rows;
+    common->rows_mask = 0;
+
+    for (uint32_t i = 0; i < common->matrix_rows; i++) {
+        common->row_bits[i] = 1ull << (i < rows ? i : i + columns);
+        common->rows_mask |= common->row_bits[i];
+    }
+}
+
+// The key map on top of the wiring build_matrix laid out
+action_code_t build_keys(const common_t * const restrict common, config_t * const restrict config,
+                         const geometry_t * const restrict geometry, const int transpose) {
+    const uint32_t columns = common->matrix_columns;
+    const uint32_t key_bits = common->key_bits;
+
+    memset(config->matrix_mask, 0, sizeof(config->matrix_mask));
+    memset(config->first_mask, 0, sizeof(config->first_mask));
+
+    for (uint32_t i = 0; i < common->matrix_rows * columns; i++) {
+        const uint32_t key = i % key_bits;
+        const uint8_t index = geometry->keys[key / columns][key % columns];
+        const int note = geometry->base_note + index + transpose;
+
+        if (index == NO_KEY) {
+            continue;
+        } else if (UNLIKELY(note < 0 || note >= MIDI_NOTES)) {
+            return READ_CONFIG_FILE_ACTION_CODE;
+        }
+
+        config->scan_table[i] = (const scan_key_t) {
+            .note       = note,
+            .row        = i / columns,
+            .second     = (i >= key_bits),
+            .key        = key,
+        };
+
+        config->matrix_mask[i / 64] |= 1ull << (i % 64);
+
+        if (i < key_bits) {
+            config->first_mask[i / 64] |= 1ull << (i % 64);
+        }
+    }
+
+    return SUCCESS_ACTION_CODE;
+}
+
+action_code_t load_curve(config_t * const restrict config, const char * const restrict path) {
+    FILE * const restrict file = fopen(path, "r");
+
+    if (UNLIKELY(file == NULL)) {
+        return OPEN_CURVE_FILE_ACTION_CODE;
+    }
+
+    uint8_t count = 0;
+    uint8_t valid = 1;
+    unsigned int time, velocity;
+
+    // get_velocity() interpolates between neighbours, and a velocity of 0 would play as a note-off
+    while (valid && count < CONFIG_MAX_CURVE_POINTS && fscanf(file, "%u %u", &time, &velocity) == 2) {
+        valid = (count == 0 || time > config->velocity_curve[count - 1].time);
+        config->velocity_curve[count++] = (const velocity_point_t) {
+            .time       = time,
+            .velocity   = (velocity > 127 ? 127 : velocity < 1 ? 1 : velocity),
+        };
+    }
+
+    fclose(file);
+
+    if (UNLIKELY(!valid || count == 0)) {
+        return READ_CURVE_FILE_ACTION_CODE;
+    }
+
+    config->velocity_points = count;
+    return SUCCESS_ACTION_CODE;
+}
+
+// 0 when a token is not a number or there are more than max of them
+static uint8_t parse_lines(char * const restrict string, uint32_t * const restrict lines, const uint8_t max) {
+    char * save;
+    uint8_t count = 0;
+
+    for (char * restrict token = strtok_r(string, ", \t\r\n", &save); token != NULL;
+         token = strtok_r(NULL, ", \t\r\n", &save)) {
+        char * end;
+
+        if (UNLIKELY(count == max)) {
+            return 0;
+        }
+
+        lines[count++] = strtoul(token, &end, 0);
+
+        if (UNLIKELY(*end != '\0')) {
+            return 0;
+        }
+    }
+
+    return count;
+}
+
+// The built-in wiring numbers its keys along rows 2, 1, 3, 4, 0 and within each row along columns
+// 7, 2, 6, 0, 4, 1, 3, 5. The last row only has five keys
+void default_keys(geometry_t * const restrict geometry) {
+    static const uint8_t rows[] = { 2, 1, 3, 4, 0 };
+    static const uint8_t columns[] = { 7, 2, 6, 0, 4, 1, 3, 5 };
+
+    for (uint32_t key = 0; key < 4 * MATRIX_COLUMNS + 5; key++) {
+        geometry->keys[rows[key / MATRIX_COLUMNS]][columns[key % MATRIX_COLUMNS]] = key;
+    }
+}
+
+// "rows", "columns" and "second-rows" list line offsets, "map <row> <key>..." numbers the keys of a row
+// from the base note with "-" for an empty crossing
+action_code_t load_geometry(geometry_t * const restrict result, const char * const restrict path) {
+    FILE * const restrict file = fopen(path, "r");
+
+    if (UNLIKELY(file == NULL)) {
+        return OPEN_GEOMETRY_FILE_ACTION_CODE;
+    }
+
+    geometry_t geometry = {
+        .base_note  = result->base_note,
+        .keys       = { [0 ... MAX_ROWS - 1][0 ... MAX_COLUMNS - 1] = NO_KEY },
+    };
+
+    char line[256];
+    uint32_t keys = 0;
+    uint8_t valid = 1;
+    uint8_t mapped[MAX_ROWS] = { 0 };
+    uint8_t notes[MIDI_NOTES / 8] = { 0 };
+
+    while (valid && fgets(line, sizeof(line), file) != NULL) {
+        char * save;
+        const char * const restrict name = strtok_r(line, " \t\r\n", &save);
+
+        if (name == NULL || name[0] == '#') {
+            continue;
+        }
+
+        if (strcmp(name, "rows") == 0) {
+            geometry.rows = parse_lines(save, geometry.row_lines, MAX_ROWS);
+        } else if (strcmp(name, "columns") == 0) {
+            geometry.columns = parse_lines(save, geometry.column_lines, MAX_COLUMNS);
+        } else if (strcmp(name, "second-rows") == 0) {
+            geometry.second_rows = parse_lines(save, geometry.second_lines, MAX_ROWS);
+        } else if (strcmp(name, "base-note") == 0) {
+            const char * const restrict value = strtok_r(NULL, " \t\r\n", &save);
+            const int base_note = (value != NULL ? atoi(value) : MIDI_NOTES);
+
+            valid = (base_note >= 0 && base_note < MIDI_NOTES);
+            geometry.base_note = base_note;
+        } else if (strcmp(name, "map") == 0) {
+            const char * restrict value = strtok_r(NULL, " \t\r\n", &save);
+            const uint32_t row = (value != NULL ? strtoul(value, NULL, 0) : MAX_ROWS);
+
+            valid = (row < MAX_ROWS && !mapped[row]);
+
+            if (valid) {
+                mapped[row] = 1;
+            }
+
+            for (uint32_t column = 0; valid && (value = strtok_r(NULL, " \t\r\n", &save)) != NULL; column++) {
+                const uint32_t key = (value[0] == '-' ? NO_KEY : strtoul(value, NULL, 0));
+
+                valid = (column < MAX_COLUMNS && (key == NO_KEY || key < MIDI_NOTES));
+                keys += (valid && key != NO_KEY);
+
+                if (valid) {
+                    geometry.keys[row][column] = key;
+                }
+            }
+        } else {
+            valid = 0;
+        }
+    }
+
+    fclose(file);
+
+    // Every mapped crossing has to be scanned and land on a note, and a scan can report each key at most once
+    for (uint32_t row = 0; valid && row < MAX_ROWS; row++) {
+        for (uint32_t column = 0; valid && column < MAX_COLUMNS; column++) {
+            const uint8_t key = geometry.keys[row][column];
+
+            valid = (key == NO_KEY ||
+                (row < geometry.rows && column < geometry.columns && geometry.base_note + key < MIDI_NOTES &&
+                 !(notes[key / 8] & (1 << (key % 8)))));
+
+            if (valid && key != NO_KEY) {
+                notes[key / 8] |= 1 << (key % 8);
+            }
+        }
+    }
+
+    if (UNLIKELY(!valid || geometry.rows == 0 || geometry.columns == 0 || keys == 0 || keys > MIDI_NOTES)) {
+        return READ_GEOMETRY_FILE_ACTION_CODE;
+    }
+
+    *result = geometry;
+    return SUCCESS_ACTION_CODE;
+}
+
+// Command line values, overridden by the -f settings file. The lines are requested once, so a reload may
+// remap the keys but has to keep the wiring
+action_code_t load_config(common_t * const restrict common, config_t * const restrict config, const uint8_t reload) {
+    char geometry_path[256] = "";
+    char curve_path[256] = "";
+    uint64_t debounce_time = common->debounce_time;
+    int transpose = common->transpose;
+
+    if (common->geometry_path != NULL) {
+        snprintf(geometry_path, sizeof(geometry_path), "%s", common->geometry_path);
+    }
+
+    if (common->curve_path != NULL) {
+        snprintf(curve_path, sizeof(curve_path), "%s", common->curve_path);
+    }
+
+    if (common->config_path != NULL) {
+        FILE * const restrict file = fopen(common->config_path, "r");
+
+        if (UNLIKELY(file == NULL)) {
+            return OPEN_CONFIG_FILE_ACTION_CODE;
+        }
+
+        char line[256];
+        const char * name;
+        const char * value;
+        uint8_t valid = 1;
+
+        while (valid && read_setting(file, line, sizeof(line), &name, &value)) {
+            if (value == NULL) {
+                valid = 0;
+            } else if (strcmp(name, "geometry") == 0) {
+                snprintf(geometry_path, sizeof(geometry_path), "%s", value);
+            } else if (strcmp(name, "velocity-curve") == 0) {
+                snprintf(curve_path, sizeof(curve_path), "%s", value);
+            } else if (strcmp(name, "debounce") == 0 && atoi(value) >= 0) {
+                debounce_time = atoi(value) * 1000ull;
+            } else if (strcmp(name, "transpose") == 0) {
+                transpose = atoi(value);
+            } else {
+                valid = 0;
+            }
+        }
+
+        fclose(file);
+
+        if (UNLIKELY(!valid)) {
+            return READ_CONFIG_FILE_ACTION_CODE;
+        }
+    }
+
+    geometry_t geometry = common->geometry;
+
+    if (geometry_path[0] != '\0') {
+        const action_code_t action_code = load_geometry(&geometry, geometry_path);
+
+        if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+            return action_code;
+        }
+    }
+
+    if (common->second_lines != NULL) {
+        char second_lines[256];
+        snprintf(second_lines, sizeof(second_lines), "%s", common->second_lines);
+        geometry.second_rows = parse_lines(second_lines, geometry.second_lines, MAX_ROWS);
+
+        // Dual contact needs a second line for every row, anything else would quietly turn it off
+        if (UNLIKELY(geometry.second_rows != geometry.rows)) {
+            return INVALID_OPTION_ACTION_CODE;
+        }
+    }
+
+    config->debounce_time = debounce_time;
+    config->velocity_points = common->velocity_points;
+    memcpy(config->velocity_curve, common->velocity_curve, sizeof(config->velocity_curve));
+
+    if (curve_path[0] != '\0') {
+        const action_code_t action_code = load_curve(config, curve_path);
+
+        if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+            return action_code;
+        }
+    }
+
+    if (!reload) {
+        common->geometry = geometry;
+        build_matrix(common);
+    } else if (geometry.rows != common->geometry.rows || geometry.columns != common->geometry.columns ||
+               geometry.second_rows != common->geometry.second_rows ||
+               memcmp(geometry.row_lines, common->geometry.row_lines, sizeof(geometry.row_lines)) != 0 ||
+               memcmp(geometry.column_lines, common->geometry.column_lines, sizeof(geometry.column_lines)) != 0 ||
+               memcmp(geometry.second_lines, common->geometry.second_lines, sizeof(geometry.second_lines)) != 0) {
+        return CHANGED_WIRING_ACTION_CODE;
+    }
+
+    return build_keys(common, config, &geometry, transpose);
+}
+
+// Runs on the sender. The spare slot is whichever one the scanner has not adopted, a config it has not
+// picked up yet is simply rebuilt
+void reload_config(common_t * const restrict common) {
+    telemetry_t * const restrict telemetry = common->telemetry;
+    config_t config;
+
+    const action_code_t action_code = load_config(common, &config, 1);
+
+    if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+        counter_add(&telemetry->reload_failures, 1);
+        counter_set(&telemetry->reload_error, (uint8_t)action_code);
+        return;
+    }
+
+    config_t * restrict slot = __atomic_exchange_n(&common->next_config, NULL, __ATOMIC_ACQUIRE);
+
+    if (slot == NULL) {
+        slot = common->configs + (common->config_published == common->configs);
+    }
+
+    *slot = config;
+    common->config_published = slot;
+    __atomic_store_n(&common->next_config, slot, __ATOMIC_RELEASE);
+    counter_add(&telemetry->reloads, 1);
+}
+
+// Owns the server socket, the scanner only ever touches the ring
+void * send_loop(void * const arg) {
+    common_t * const restrict common = arg;
+    sigset_t sigset;
+
+    // Stats requests and quits land on the scanner
+    sigfillset(&sigset);
+    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+    common->down_time = get_time_ns();
+    common->link_time = common->down_time;
+
+    while (!__atomic_load_n(&common->sender_stop, __ATOMIC_ACQUIRE)) {
+        if (UNLIKELY(__atomic_exchange_n(&common->reload, 0, __ATOMIC_ACQUIRE))) {
+            reload_config(common);
+        }
+
+        if (common->link != LINK_UP) {
+            service_link(common);
+        }
+
+        if (common->resend_at != 0 && get_time_ns() >= common->resend_at) {
+            resend_datagram(common);
+        }
+
+        if (drain_ring(common) > 0) {
+            continue;
+        }
+
+        __atomic_store_n(&common->sender_waiting, 1, __ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(&common->ring_tail, __ATOMIC_SEQ_CST) != common->ring_head) {
+            __atomic_store_n(&common->sender_waiting, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        struct pollfd pollfds[2] = {
+            { .fd = common->wake_fd,    .events = POLLIN },
+            { .fd = common->server_fd,  .events = (common->link == LINK_CONNECTING ? POLLOUT : POLLIN) },
+        };
+
+        const int timeout = idle_timeout(common, -1);
+        const struct timespec timespec = {
+            .tv_sec     = timeout / 1000000,
+            .tv_nsec    = timeout % 1000000 * 1000,
+        };
+
+        const int result = ppoll(pollfds, 2, (timeout < 0 ? NULL : &timespec), NULL);
+        __atomic_store_n(&common->sender_waiting, 0, __ATOMIC_RELAXED);
+
+        if (result > 0 && pollfds[0].revents != 0) {
+            uint64_t wake;
+            read(common->wake_fd, &wake, sizeof(wake));
+        }
+
+        if (result > 0 && pollfds[1].revents != 0) {
+            service_link(common);
+        }
+    }
+
+    return NULL;
+}
+
+action_code_t start_sender(common_t * const restrict common, pthread_t * const restrict thread) {
+    common->server_addr = (const struct sockaddr_in) {
+        .sin_family         = AF_INET,
+        .sin_port           = htons(common->server_port),
+        .sin_addr.s_addr    = htonl(INADDR_LOOPBACK),
+    };
+
+    const char * const server_ip = common->server_ip;
+
+    if (server_ip != NULL) {
+        inet_pton(AF_INET, server_ip, &common->server_addr.sin_addr);
+    }
+
+    if (common->udp) {
+        common->session = get_time_ns() ^ getpid();
+    }
+
+    const int wake_fd = eventfd(0, EFD_NONBLOCK);
+
+    if (UNLIKELY(wake_fd < 0)) {
+        return CREATE_SENDER_ACTION_CODE;
+    } else {
+        common->wake_fd = wake_fd;
+    }
+
+    if (UNLIKELY(pthread_create(thread, NULL, send_loop, common) != 0)) {
+        return CREATE_SENDER_ACTION_CODE;
+    }
+
+    return SUCCESS_ACTION_CODE;
+}
+
+// A new key map only takes over with every key up, so no note is left sounding under its old number
+static inline void adopt_config(common_t * const restrict common) {
+    if (matrix_busy(common) || matrix_in_flight(common)) {
+        return;
+    }
+
+    config_t * const restrict config = __atomic_exchange_n(&common->next_config, NULL, __ATOMIC_ACQUIRE);
+
+    if (config != NULL) {
+        common->gpio->adopt(common, config);
+        common->config = config;
+    }
+}
+
+// Paced scans sleep to the next period and free running ones go on while anything moves, both wait for
+// an edge once the keyboard is still, for at most max_idle us
+action_code_t scan_wait(common_t * const restrict common, const uint8_t midi_event_count,
+                        int * const restrict gpio_timeout, uint64_t * const restrict deadline, const int max_idle) {
+    if (midi_event_count > 0) {
+        *gpio_timeout = 1;
+    }
+
+    if (common->scan_period != 0) {
+        if (midi_event_count > 0 || matrix_busy(common) || matrix_in_flight(common)) {
+            scan_sleep(common, deadline);
+            return SUCCESS_ACTION_CODE;
+        }
+
+        const action_code_t action_code = gpio_idle(common, max_idle);
+
+        if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+            return action_code;
+        }
+
+        *deadline = get_time_ns();
+    } else if (midi_event_count == 0 && !matrix_in_flight(common)) {
+        const action_code_t action_code = gpio_idle(common, (matrix_busy(common) ? *gpio_timeout : max_idle));
+
+        if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+            return action_code;
+        }
+
+        if (*gpio_timeout < CONFIG_MAX_GPIO_TIMEOUT) {
+            *gpio_timeout <<= 1;
+        }
+    }
+
+    return SUCCESS_ACTION_CODE;
+}
+
+action_code_t main_loop(common_t * const restrict common) {
+    int gpio_timeout = 1;
+    uint64_t deadline = get_time_ns();
+
+    while (1) {
+        if (UNLIKELY(stats_requested)) {
+            stats_requested = 0;
+            write_stats(common);
+        }
+
+        // The sender does the file reading, the scan only ever swaps a pointer
+        if (UNLIKELY(reload_requested)) {
+            const uint64_t wake = 1;
+
+            reload_requested = 0;
+            __atomic_store_n(&common->reload, 1, __ATOMIC_RELEASE);
+            write(common->wake_fd, &wake, sizeof(wake));
+        }
+
+        if (UNLIKELY(__atomic_load_n(&common->next_config, __ATOMIC_RELAXED) != NULL)) {
+            adopt_config(common);
+        }
+
+        uint8_t midi_event_count;
+        midi_event_t midi_events[MATRIX_BITS];
+
+        action_code_t result = scan_matrix(common, midi_events, &midi_event_count, 0);
+
+        if (UNLIKELY(result != SUCCESS_ACTION_CODE)) {
+            return result;
+        }
+
+        if (midi_event_count > 0) {
+            ring_push(common, midi_events, midi_event_count, common->scan_time);
+        }
+
+        result = scan_wait(common, midi_event_count, &gpio_timeout, &deadline, -1);
+
+        if (UNLIKELY(result != SUCCESS_ACTION_CODE)) {
+            return result;
+        }
+    }
+}
+
+action_code_t chip_open(common_t * const restrict common) {
+    const int chip_fd = open(common->gpio_chip, 0);
+
+    if (UNLIKELY(chip_fd < 0)) {
+        return OPEN_GPIO_CHIP_ACTION_CODE;
+    } else {
+        common->chip_fd = chip_fd;
+    }
+
+    const geometry_t * const restrict geometry = &common->geometry;
+
+    struct gpio_v2_line_request request = {
+        .consumer       = APP_NAME,
+        .config         = {
+            .flags      = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING,
+            .num_attrs  = 2,
+            .attrs      = {
+                {
+                    .attr.id        = GPIO_V2_LINE_ATTR_ID_FLAGS,
+                    .attr.flags     = GPIO_V2_LINE_FLAG_OUTPUT,
+                    .mask           = common->rows_mask,
+                },
+                {
+                    .attr.id        = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES,
+                    .attr.values    = 0,
+                    .mask           = common->rows_mask,
+                },
+            },
+        },
+        .num_lines      = geometry->rows + geometry->columns,
+    };
+
+    memcpy(request.offsets, geometry->row_lines, geometry->rows * sizeof(uint32_t));
+    memcpy(request.offsets + geometry->rows, geometry->column_lines, geometry->columns * sizeof(uint32_t));
+
+    if (common->dual_contact) {
+        memcpy(request.offsets + request.num_lines, geometry->second_lines, geometry->rows * sizeof(uint32_t));
+        request.num_lines += geometry->rows;
+    }
+
+    const int result = ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &request);
+
+    close(chip_fd);
+    common->chip_fd = -1;
+
+    if (UNLIKELY(result < 0)) {
+        return IOCTL_GPIO_LINES_ACTION_CODE;
+    } else {
+        common->line_fd = request.fd;
+        common->rows = 0;
+    }
+
+    fcntl(request.fd, F_SETFL, O_NONBLOCK);
+    return SUCCESS_ACTION_CODE;
+}
+
+int chip_values(common_t * const restrict common, const unsigned long request,
+                struct gpio_v2_line_values * const restrict values) {
+    return ioctl(common->line_fd, request, values);
+}
+
+void chip_drain(common_t * const restrict common) {
+    while (1) {
+        struct gpio_v2_line_event line_events[CONFIG_MAX_GPIO_EVENTS];
+        const int result = read(common->line_fd, line_events, sizeof(line_events));
+
+        if (result < (int)sizeof(line_events)) {
+            break;
+        }
+    }
+}
+
+int chip_wait(common_t * const restrict common, const int timeout) {
+    struct pollfd pollfd = {
+        .fd         = common->line_fd,
+        .events     = POLLIN,
+    };
+
+    const struct timespec timespec = {
+        .tv_sec     = timeout / 1000000,
+        .tv_nsec    = timeout % 1000000 * 1000,
+    };
+
+    return ppoll(&pollfd, 1, (timeout < 0 ? NULL : &timespec), NULL);
+}
+
+void chip_adopt(common_t * const restrict common UNUSED, const config_t * const restrict config UNUSED) {
+}
+
+static const gpio_backend_t chip_backend = {
+    .open       = chip_open,
+    .values     = chip_values,
+    .drain      = chip_drain,
+    .wait       = chip_wait,
+    .adopt      = chip_adopt,
+};
+
+// "<us> <note> press|release [<travel us>]" lines script the keys, "bounce <us> <flips>" makes every contact
+// chatter for that long and "latency <us>" is what each line read or write costs
+action_code_t load_sim(sim_t * const restrict sim, const char * const restrict path) {
+    FILE * const restrict file = fopen(path, "r");
+
+    if (UNLIKELY(file == NULL)) {
+        return OPEN_SIM_FILE_ACTION_CODE;
+    }
+
+    char line[256];
+    const char * name;
+    const char * value;
+    uint8_t valid = 1;
+
+    sim->event_count = 0;
+    sim->bounce_time = 0;
+    sim->bounces = 0;
+    sim->latency = 0;
+
+    while (valid && read_setting(file, line, sizeof(line), &name, &value)) {
+        unsigned int note, bounces, travel = 0;
+        char action[16];
+
+        if (value == NULL) {
+            valid = 0;
+        } else if (strcmp(name, "bounce") == 0) {
+            valid = (sscanf(value, "%llu %u", (unsigned long long *)&sim->bounce_time, &bounces) == 2 &&
+                bounces <= CONFIG_MAX_SIM_BOUNCES);
+            sim->bounce_time *= 1000;
+            sim->bounces = bounces;
+        } else if (strcmp(name, "latency") == 0 && atoi(value) >= 0) {
+            sim->latency = atoi(value) * 1000ull;
+        } else if (name[0] >= '0' && name[0] <= '9' && sim->event_count < CONFIG_MAX_SIM_EVENTS) {
+            valid = (sscanf(value, "%u %15s %u", &note, action, &travel) >= 2 && note < MIDI_NOTES &&
+                (strcmp(action, "press") == 0 || strcmp(action, "release") == 0));
+
+            if (valid) {
+                sim->events[sim->event_count++] = (const sim_event_t) {
+                    .time       = strtoull(name, NULL, 10) * 1000,
+                    .travel     = travel * 1000,
+                    .note       = note,
+                    .press      = (action[0] == 'p'),
+                };
+            }
+        } else {
+            valid = 0;
+        }
+    }
+
+    fclose(file);
+
+    if (UNLIKELY(!valid || sim->event_count == 0)) {
+        return READ_SIM_FILE_ACTION_CODE;
+    }
+
+    return SUCCESS_ACTION_CODE;
+}
+
+static inline void sim_contact(sim_t * const restrict sim, const uint32_t bit, const uint32_t stride,
+                               const uint64_t time, const uint8_t closed) {
+    const uint32_t flips = (sim->bounce_time != 0 ? 2 * sim->bounces : 0);
+
+    for (uint32_t i = 0; i <= flips; i++) {
+        sim->edges[sim->edge_count++] = (const sim_edge_t) {
+            .time       = time + (flips != 0 ? sim->bounce_time * i / flips : 0),
+            .row        = bit / stride,
+            .column     = bit % stride,
+            .closed     = closed ^ (i & 1),
+        };
+    }
+}
+
+static int compare_edges(const void * const a, const void * const b) {
+    const uint64_t time_a = ((const sim_edge_t *)a)->time;
+    const uint64_t time_b = ((const sim_edge_t *)b)->time;
+
+    return (time_a > time_b) - (time_a < time_b);
+}
+
+// Starts the timeline over with every contact open
+void sim_reset(sim_t * const restrict sim) {
+    memset(sim->closed, 0, sizeof(sim->closed));
+    sim->next_edge = 0;
+    sim->start = get_time_ns();
+}
+
+// A press closes the first contact and the second one travel later, a release opens them the other way round.
+// Edges follow the notes of config, a scripted note no key plays is an error unless skip is set
+action_code_t build_sim(common_t * const restrict common, const config_t * const restrict config,
+                        const uint8_t skip) {
+    sim_t * const restrict sim = &common->sim;
+    const uint32_t stride = common->matrix_columns;
+    const uint32_t bits = common->matrix_rows * stride;
+
+    sim->edge_count = 0;
+    sim->end = 0;
+
+    for (uint32_t i = 0; i < sim->event_count; i++) {
+        const sim_event_t * const restrict event = sim->events + i;
+        int contacts[2] = { -1, -1 };
+
+        for (uint32_t bit = 0; bit < bits; bit++) {
+            if (((config->matrix_mask[bit / 64] >> (bit % 64)) & 1) && config->scan_table[bit].note == event->note) {
+                contacts[config->scan_table[bit].second] = bit;
+            }
+        }
+
+        if (contacts[0] < 0) {
+            if (skip) {
+                continue;
+            }
+
+            return READ_SIM_FILE_ACTION_CODE;
+        }
+
+        const uint64_t later = event->time + (contacts[1] >= 0 ? event->travel : 0);
+
+        sim_contact(sim, contacts[0], stride, (event->press ? event->time : later), event->press);
+
+        if (contacts[1] >= 0) {
+            sim_contact(sim, contacts[1], stride, (event->press ? later : event->time), event->press);
+        }
+
+        if (later + sim->bounce_time > sim->end) {
+            sim->end = later + sim->bounce_time;
+        }
+    }
+
+    qsort(sim->edges, sim->edge_count, sizeof(sim_edge_t), compare_edges);
+
+    return SUCCESS_ACTION_CODE;
+}
+
+action_code_t sim_open(common_t * const restrict common) {
+    const action_code_t action_code = load_sim(&common->sim, common->sim_path);
+
+    if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+        return action_code;
+    }
+
+    common->rows = 0;
+    common->sim.rows = 0;
+
+    const action_code_t result = build_sim(common, common->config, 0);
+    sim_reset(&common->sim);
+
+    return result;
+}
+
+// A reloaded geometry or transpose moves the notes to other keys, the timeline keeps its place. Contacts
+// start open and the next read replays every edge already due
+void sim_adopt(common_t * const restrict common, const config_t * const restrict config) {
+    sim_t * const restrict sim = &common->sim;
+
+    build_sim(common, config, 1);
+    memset(sim->closed, 0, sizeof(sim->closed));
+    sim->next_edge = 0;
+}
+
+// The latency is spun away on the scanning core, the way a real ioctl would spend it in the kernel
+int sim_values(common_t * const restrict common, const unsigned long request,
+               struct gpio_v2_line_values * const restrict values) {
+    sim_t * const restrict sim = &common->sim;
+    const uint64_t start = get_time_ns();
+
+    while (get_time_ns() - start < sim->latency);
+
+    const uint64_t now = get_time_ns() - sim->start;
+
+    for (; sim->next_edge < sim->edge_count && sim->edges[sim->next_edge].time <= now; sim->next_edge++) {
+        const sim_edge_t * const restrict edge = sim->edges + sim->next_edge;
+        const uint32_t bit = 1u << edge->column;
+
+        sim->closed[edge->row] = (edge->closed ? sim->closed[edge->row] | bit : sim->closed[edge->row] & ~bit);
+    }
+
+    if (request == GPIO_V2_LINE_SET_VALUES_IOCTL) {
+        sim->rows = (sim->rows & ~values->mask) | (values->bits & values->mask);
+        return 0;
+    }
+
+    uint32_t columns = 0;
+
+    for (uint32_t i = 0; i < common->matrix_rows; i++) {
+        columns |= (sim->rows & common->row_bits[i] ? sim->closed[i] : 0);
+    }
+
+    values->bits = ((uint64_t)columns << common->geometry.rows) & values->mask;
+    return 0;
+}
+
+void sim_drain(common_t * const restrict common UNUSED) {
+}
+
+// Sleeps until the next scripted edge, on any contact, or the timeout
+int sim_wait(common_t * const restrict common, const int timeout) {
+    const sim_t * const restrict sim = &common->sim;
+    const uint64_t now = get_time_ns();
+    uint64_t wake = (timeout < 0 ? UINT64_MAX : now + timeout * 1000ull);
+
+    if (sim->next_edge < sim->edge_count && sim->start + sim->edges[sim->next_edge].time < wake) {
+        wake = sim->start + sim->edges[sim->next_edge].time;
+    }
+
+    const uint64_t sleep = (wake > now ? wake - now : 0);
+
+    const struct timespec timespec = {
+        .tv_sec     = sleep / 1000000000,
+        .tv_nsec    = sleep % 1000000000,
+    };
+
+    return ppoll(NULL, 0, (wake == UINT64_MAX ? NULL : &timespec), NULL);
+}
+
+static const gpio_backend_t sim_backend = {
+    .open       = sim_open,
+    .values     = sim_values,
+    .drain      = sim_drain,
+    .wait       = sim_wait,
+    .adopt      = sim_adopt,
+};
+
+// The last core by default, on a single core machine the scanner is left where it is
+action_code_t pin_scanner(const common_t * const restrict common) {
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    const int cpu = (common->scan_cpu >= 0 ? common->scan_cpu : cpus - 1);
+
+    if (common->scan_cpu < 0 && cpus < 2) {
+        return SUCCESS_ACTION_CODE;
+    }
+
+    if (UNLIKELY(cpu >= cpus || cpu >= CPU_SETSIZE)) {
+        return SCAN_CPU_ACTION_CODE;
+    }
+
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(cpu, &cpu_set);
+
+    if (UNLIKELY(sched_setaffinity(0, sizeof(cpu_set), &cpu_set) < 0)) {
+        return SCAN_CPU_ACTION_CODE;
+    }
+
+    return SUCCESS_ACTION_CODE;
+}
+
+action_code_t init_daemon(common_t * const restrict common) {
+    telemetry_t * const restrict telemetry = map_telemetry(common->telemetry_path, sizeof(telemetry_t), 1);
+
+    if (telemetry != NULL) {
+        telemetry->header = (const telemetry_header_t) {
+            .magic      = TELEMETRY_MAGIC,
+            .size       = sizeof(telemetry_t),
+            .pid        = getpid(),
+            .start_time = get_time_ns(),
+        };
+
+        common->telemetry = telemetry;
+    }
+
+    action_code_t action_code = common->gpio->open(common);
+
+    if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+        return action_code;
+    }
+
+#ifdef LOCAL
+    action_code = open_seq(common);
+
+    if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+        return action_code;
+    }
+#endif
+
+    pthread_t sender;
+    action_code = start_sender(common, &sender);
+
+    if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+        return action_code;
+    }
+
+    // The sender was started first and keeps the default affinity and policy
+    action_code = pin_scanner(common);
+
+    if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+        return action_code;
+    }
+
+    if (common->realtime) {
+        const struct sched_param param = {
+            .sched_priority = CONFIG_RT_PRIORITY,
+        };
+
+        int result = sched_setscheduler(0, SCHED_FIFO, &param);
+
+        if (UNLIKELY(result < 0)) {
+            return SCHED_FIFO_ACTION_CODE;
+        }
+
+        result = mlockall(MCL_CURRENT | MCL_FUTURE);
+
+        if (UNLIKELY(result < 0)) {
+            return MLOCKALL_ACTION_CODE;
+        }
+    }
+
+    return main_loop(common);
+}
+
+void * bench_sink(void * const arg) {
+    const int fd = *(const int *)arg;
+    uint8_t buffer[4096];
+
+    while (read(fd, buffer, sizeof(buffer)) > 0);
+    return NULL;
+}
+
+// Paced scans each hand the sender one event, which it writes to a pipe a sink thread empties;
+// the scan lateness shows how much of the network's delay reaches the scanner
+action_code_t bench_jitter(common_t * const restrict common, const int scans, const uint64_t net_delay) {
+    int pipe_fds[2];
+
+    if (UNLIKELY(pipe(pipe_fds) < 0)) {
+        return CREATE_BENCH_PIPE_ACTION_CODE;
+    }
+
+    pthread_t sink, sender;
+
+    if (UNLIKELY(pthread_create(&sink, NULL, bench_sink, pipe_fds) != 0)) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return CREATE_BENCH_SINK_ACTION_CODE;
+    }
+
+    common->server_fd = pipe_fds[1];
+#ifdef LOCAL
+    common->seq_fd = pipe_fds[1];
+#endif
+    common->link = LINK_UP;
+    common->features = 0;
+    common->net_delay = net_delay;
+    common->sender_stop = 0;
+
+    memset(&common->scan_late, 0, sizeof(common->scan_late));
+    common->scan_overruns = 0;
+    counter_set(&common->telemetry->ring_high, 0);
+    counter_set(&common->telemetry->ring_overflows, 0);
+
+    action_code_t action_code = start_sender(common, &sender);
+    uint64_t deadline = get_time_ns();
+
+    for (int i = 0; i < scans && action_code == SUCCESS_ACTION_CODE; i++) {
+        uint8_t midi_event_count;
+        midi_event_t midi_events[MATRIX_BITS];
+
+        action_code = scan_matrix(common, midi_events, &midi_event_count, 1);
+
+        const midi_event_t midi_event = {
+            .key        = 60,
+            .velocity   = (i % 2 == 0 ? 100 : 0),
+        };
+
+        ring_push(common, &midi_event, 1, common->scan_time);
+        scan_sleep(common, &deadline);
+    }
+
+    const uint64_t wake = 1;
+
+    __atomic_store_n(&common->sender_stop, 1, __ATOMIC_RELEASE);
+    write(common->wake_fd, &wake, sizeof(wake));
+    pthread_join(sender, NULL);
+
+    close(common->wake_fd);
+    close(pipe_fds[1]);
+    pthread_join(sink, NULL);
+    close(pipe_fds[0]);
+
+    common->wake_fd = -1;
+    common->server_fd = -1;
+    common->net_delay = 0;
+#ifdef LOCAL
+    common->seq_fd = -1;
+#endif
+
+    const hist_t * const restrict late = &common->scan_late;
+
+    printf("Paced scan, %llu us per send: lateness p50 %llu ns, p99 %llu ns, max %llu ns, "
+           "%llu overruns, ring high %llu, %llu overflowed\n",
+        (unsigned long long)(net_delay / 1000),
+        (unsigned long long)hist_percentile(late, 5000),
+        (unsigned long long)hist_percentile(late, 9900),
+        (unsigned long long)late->max,
+        (unsigned long long)common->scan_overruns,
+        (unsigned long long)counter_get(&common->telemetry->ring_high),
+        (unsigned long long)counter_get(&common->telemetry->ring_overflows));
+    fflush(stdout);
+
+    return action_code;
+}
+
+// Plays the timeline once through the daemon's own scan and idle policy, then matches what was detected
+// against the script: every change should come out once, after its first edge
+action_code_t bench_timeline(common_t * const restrict common) {
+    static ring_entry_t detected[4 * CONFIG_MAX_SIM_EVENTS];
+    static uint8_t matched[CONFIG_MAX_SIM_EVENTS];
+    const config_t * const restrict config = common->config;
+    sim_t * const restrict sim = &common->sim;
+    hist_t latency;
+    uint32_t count = 0;
+
+    memset(&latency, 0, sizeof(latency));
+    memset(matched, 0, sizeof(matched));
+    memset(common->matrix, 0, sizeof(common->matrix));
+    memset(common->locked, 0, sizeof(common->locked));
+    memset(common->sounding, 0, sizeof(common->sounding));
+    common->columns = 0;
+    common->last_scan = 0;
+
+    const uint64_t scans = counter_get(&common->telemetry->scans);
+    int gpio_timeout = 1;
+    uint64_t deadline = get_time_ns();
+    action_code_t action_code = SUCCESS_ACTION_CODE;
+
+    sim_reset(sim);
+
+    const uint64_t end = sim->start + sim->end + config->debounce_time + CONFIG_SIM_SETTLE;
+
+    for (uint64_t now = sim->start; now < end && action_code == SUCCESS_ACTION_CODE; now = get_time_ns()) {
+        uint8_t midi_event_count;
+        midi_event_t midi_events[MATRIX_BITS];
+
+        action_code = scan_matrix(common, midi_events, &midi_event_count, 0);
+
+        for (uint8_t i = 0; i < midi_event_count && count < sizeof(detected) / sizeof(detected[0]); i++) {
+            detected[count++] = (const ring_entry_t) {
+                .scan_time  = common->scan_time - sim->start,
+                .event      = midi_events[i],
+            };
+        }
+
+        if (action_code == SUCCESS_ACTION_CODE) {
+            action_code = scan_wait(common, midi_event_count, &gpio_timeout, &deadline, (end - now) / 1000);
+        }
+    }
+
+    uint32_t extra = 0;
+    uint32_t found = 0;
+    uint64_t velocity_error = 0;
+
+    // Each detection takes the latest unmatched change of its note and direction that came before it,
+    // so a change the scan never saw counts as missed rather than delaying every later one
+    for (uint32_t i = 0; i < count; i++) {
+        const midi_event_t * const restrict event = &detected[i].event;
+        uint32_t best = CONFIG_MAX_SIM_EVENTS;
+        uint64_t best_time = 0;
+
+        for (uint32_t j = 0; j < sim->event_count; j++) {
+            const sim_event_t * const restrict change = sim->events + j;
+            const uint64_t time = change->time + (common->dual_contact ? change->travel : 0);
+
+            if (!matched[j] && change->note == event->key && change->press == (event->velocity > 0) &&
+                time <= detected[i].scan_time && (best == CONFIG_MAX_SIM_EVENTS || time > best_time)) {
+                best = j;
+                best_time = time;
+            }
+        }
+
+        if (best == CONFIG_MAX_SIM_EVENTS) {
+            extra++;
+            continue;
+        }
+
+        const sim_event_t * const restrict change = sim->events + best;
+        const uint8_t velocity = (common->dual_contact ? get_velocity(config, change->travel) : 100);
+
+        matched[best] = 1;
+        found++;
+        hist_add(&latency, detected[i].scan_time - best_time);
+
+        if (change->press) {
+            velocity_error += (event->velocity > velocity ? event->velocity - velocity : velocity - event->velocity);
+        }
+    }
+
+    printf("Timeline: %u of %u changes detected, %u extra, latency p50 %llu ns, p99 %llu ns, max %llu ns, "
+           "velocity off by %.1f, %llu scans\n",
+        found, sim->event_count, extra,
+        (unsigned long long)hist_percentile(&latency, 5000),
+        (unsigned long long)hist_percentile(&latency, 9900),
+        (unsigned long long)latency.max,
+        (found > 0 ? (double)velocity_error / found : 0.0),
+        (unsigned long long)(counter_get(&common->telemetry->scans) - scans));
+    fflush(stdout);
+
+    return action_code;
+}
+
+action_code_t bench(common_t * const restrict common, const int scans, const uint64_t slow_delay) {
+    action_code_t action_code = common->gpio->open(common);
+
+    if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+        return action_code;
+    }
+
+    for (uint8_t full = 0; full < 2; full++) {
+        const uint64_t gpio_ioctls = common->telemetry->gpio_ioctls;
+        const uint64_t start = get_time_ns();
+
+        for (int i = 0; i < scans; i++) {
+            uint8_t midi_event_count;
+            midi_event_t midi_events[MATRIX_BITS];
+
+            action_code = scan_matrix(common, midi_events, &midi_event_count, full);
+
+            if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+                return action_code;
+            }
+        }
+
+        const uint64_t time = get_time_ns() - start;
+
+        printf("%s scan: %.0f scans/s, %.2f ioctls/scan\n", (full ? "Full" : "Probe"),
+            scans * 1e9 / time, (double)(common->telemetry->gpio_ioctls - gpio_ioctls) / scans);
+    }
+
+    fflush(stdout);
+
+    const uint64_t scan_period = common->scan_period;
+
+    if (common->scan_period == 0) {
+        common->scan_period = 1000000000 / CONFIG_BENCH_SCAN_RATE;
+    }
+
+    pin_scanner(common);
+
+    const uint64_t net_delay = (slow_delay != 0 ? slow_delay : CONFIG_BENCH_NET_DELAY * 1000ull);
+
+    for (uint8_t slow = 0; slow < 2 && action_code == SUCCESS_ACTION_CODE; slow++) {
+        action_code = bench_jitter(common, scans, (slow ? net_delay : 0));
+    }
+
+    // The timeline runs at the rate the daemon would, not the one the jitter runs needed
+    if (common->sim_path != NULL && action_code == SUCCESS_ACTION_CODE) {
+        common->scan_period = scan_period;
+        bench_timeline(common);
+    }
+
+    close(common->line_fd);
+    common->line_fd = -1;
+
+    return SUCCESS_ACTION_CODE;
+}
+
+uint8_t close_daemon(common_t * const restrict common, UNUSED const action_code_t action_code) {
+    if (common->line_fd >= 0) {
+        close(common->line_fd);
+    }
+
+    if (common->chip_fd >= 0) {
+        close(common->chip_fd);
+    }
+
+#ifdef LOCAL
+    if (common->seq_fd >= 0) {
+        close(common->seq_fd);
+    }
+#endif
+
+    return 1;
+}
+
+void daemon_signal(UNUSED const int code) {
+}
+
+action_code_t started_daemon(common_t * const restrict common, const pid_t pid) {
+    return write_pid(common, pid);
+}
+
+#ifdef LOCAL
+// The note leaves this process's own sequencer port, -o gives it somewhere to go
+action_code_t test(common_t * const restrict common, const uint8_t key) {
+    action_code_t action_code = open_seq(common);
+
+    if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+        return action_code;
+    }
+
+    midi_event_t event = {
+        .key        = key,
+        .velocity   = 100,
+    };
+
+    uint8_t sent;
+    action_code = send_events(common, &event, 1, get_time_ns(), &sent);
+
+    if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+        return action_code;
+    }
+
+    event.velocity = 0;
+    sleep(CONFIG_TEST_KEY_TIMEOUT);
+
+    return send_events(common, &event, 1, get_time_ns(), &sent);
+}
+#endif
+
+int main(const int argc, char * const argv[]) {
+    process_t process = STANDARD_PROCESS;
+    uint8_t test_key = 0;
+    int bench_scans = 0;
+    uint64_t bench_delay = 0;
+
+    while (1) {
+        static const struct option options[] = {
+#ifndef LOCAL
+            {
+                .name       = "server",
+                .has_arg    = required_argument,
+                .flag       = NULL,
+                .val        = 's',
+            },
+#endif
+            {
+                .name       = "gpio-chip",
+                .has_arg    = required_argument,
+                .flag       = NULL,
+                .val        = 'g',
+            },
+            {
+                .name       = "scan-rate",
+                .has_arg    = required_argument,
+                .flag       = NULL,
+                .val        = 'r',
+            },
+            {
+                .name       = "realtime",
+                .has_arg    = no_argument,
+                .flag       = NULL,
+                .val        = 'R',
+            },
+            {
+                .name       = "debounce",
+                .has_arg    = required_argument,
+                .flag       = NULL,
+                .val        = 'd',
+            },
+            {
+                .name       = "dual-contact",
+                .has_arg    = required_argument,
+                .flag       = NULL,
+                .val        = 'c',
+            },
+            {
+                .name       = "geometry",
+                .has_arg    = required_argument,
+                .flag       = NULL,
+                .val        = 'G',
+            },
+            {
+                .name       = "velocity-curve",
+                .has_arg    = required_argument,
+                .flag       = NULL,
+                .val        = 'V',
+            },
+            {
+                .name       = "transpose",
+                .has_arg    = required_argument,
+                .flag       = NULL,
+                .val        = 'T',
+            },
+            {
+                .name       = "config",
+                .has_arg    = required_argument,
+                .flag       = NULL,
+                .val        = 'f',
+            },
+            {
+                .name       = "device-id",
+                .has_arg    = required_argument,
+                .flag       = NULL,
+                .val        = 'i',
+            },
+            {
+                .name       = "channel",
+                .has_arg    = required_argument,
+                .flag       = NULL,
+                .val        = 'm',
+            },
+            {
+                .name       = "scan-cpu",
+                .has_arg    = required_argument,
+                .flag       = NULL,
+                .val        = 'C',
+            },
+            {
+                .name       = "net-delay",
+                .has_arg    = required_argument,
+                .flag       = NULL,
+                .val        = 'D',
+            },
+            {
+                .name       = "bench-scan",
+                .has_arg    = required_argument,
+                .flag       = NULL,
+                .val        = 'b',
+            },
+#ifdef LOCAL
+            {
+                .name       = "seq-device",
+                .has_arg    = required_argument,
+                .flag       = NULL,
+                .val        = 'S',
+            },
+            {
+                .name       = "output",
+                .has_arg    = required_argument,
+                .flag       = NULL,
+                .val        = 'o',
+            },
+#endif
+            COMMON_OPTIONS,
+            {   NULL, 0, NULL, 0    }
+        };
+
+#ifdef LOCAL
+        const int opt = getopt_long(argc, argv, "S:o:g:r:Rd:c:G:V:T:f:i:m:C:D:b:l:p:qHvt:h", options, NULL);
+#else
+        const int opt = getopt_long(argc, argv, "s:g:r:Rd:c:G:V:T:f:i:m:C:D:b:l:p:qHvt:h", options, NULL);
+#endif
+
+        if (UNLIKELY(opt < 0)) {
+            break;
+        }
+
+        if (common_option(&common, opt, &process, &test_key)) {
+            continue;
+        }
+
+        switch (opt) {
+            case 's': {
+                if (strncmp(optarg, "udp://", 6) == 0) {
+                    common.udp = 1;
+                    optarg += 6;
+                }
+
+                char * restrict port = strchr(optarg, ':');
+
+                if (port != NULL) {
+                    *port++ = '\0';
+                    common.server_port = atoi(port);
+                }
+
+                common.server_ip = optarg;
+            } break;
+            case 'g': {
+                if (strncmp(optarg, "sim:", 4) == 0) {
+                    common.sim_path = optarg + 4;
+                }
+
+                common.gpio_chip = optarg;
+            } break;
+            case 'r': {
+                const int scan_rate = atoi(optarg);
+                common.scan_period = (scan_rate > 0 ? 1000000000 / scan_rate : 0);
+            } break;
+            case 'R': common.realtime = 1; break;
+            case 'd': {
+                const int debounce = atoi(optarg);
+
+                if (UNLIKELY(debounce < 0)) {
+                    return INVALID_OPTION_ACTION_CODE;
+                }
+
+                common.debounce_time = debounce * 1000ull;
+            } break;
+            case 'c': common.second_lines = optarg; break;
+            case 'G': common.geometry_path = optarg; break;
+            case 'V': common.curve_path = optarg; break;
+            case 'T': common.transpose = atoi(optarg); break;
+            case 'f': common.config_path = optarg; break;
+            case 'i': common.device = strtoul(optarg, NULL, 0); break;
+            case 'm': {
+                long long channel;
+
+                if (UNLIKELY(!parse_number(optarg, 0, MIDI_CHANNELS - 1, &channel))) {
+                    return INVALID_OPTION_ACTION_CODE;
+                }
+
+                common.channel = channel;
+            } break;
+            case 'C': {
+                common.scan_cpu = atoi(optarg);
+
+                if (UNLIKELY(common.scan_cpu < 0)) {
+                    return INVALID_OPTION_ACTION_CODE;
+                }
+            } break;
+            case 'D': {
+                const int delay = atoi(optarg);
+
+                if (UNLIKELY(delay < 0)) {
+                    return INVALID_OPTION_ACTION_CODE;
+                }
+
+                bench_delay = delay * 1000ull;
+            } break;
+#ifdef LOCAL
+            case 'S': common.seq_path = optarg; break;
+            case 'o': parse_seq_addr(optarg, &common.seq_connect); break;
+#endif
+            case 'b': {
+                process = BENCH_PROCESS;
+                bench_scans = atoi(optarg);
+            } break;
+            case '?': case 'h': {
+                static const char help[] =
+#ifdef LOCAL
+                    "GPIO-MIDI RPI local v0.0.1\n"
+                    "-S, --seq-device\t:\tSequencer device, a FIFO or /dev/null works as a sink (" SND_SEQ ")\n"
+                    "-o, --output\t:\tConnect the sequencer port to client:port, e.g. -o 128:0 (subscribers only)\n"
+#else
+                    "GPIO-MIDI RPI client v0.0.1\n"
+                    "-s, --server\t:\tServer IP and port (127.0.0.1:9001), udp:// prefix for datagrams\n"
+#endif
+                    "-g, --gpio-chip\t:\tGPIO chip device, or sim:<timeline> for a simulated matrix (" GPIO_CHIP ")\n"
+                    "-r, --scan-rate\t:\tFixed scan rate in Hz (off)\n"
+                    "-R, --realtime\t:\tRun with SCHED_FIFO and locked memory\n"
+                    "-d, --debounce\t:\tKey lockout after an edge in us (2000)\n"
+                    "-c, --dual-contact\t:\tSecond contact row lines for velocity (-c 5,6,12,13,16)\n"
+                    "-G, --geometry\t:\tKey matrix file of row and column lines, key map and base note\n"
+                    "-V, --velocity-curve\t:\tFile of \"us velocity\" points for dual contact keys\n"
+                    "-T, --transpose\t:\tShift every key by N semitones (0)\n"
+                    "-f, --config\t:\tSettings file of geometry, velocity-curve, debounce and transpose lines, reread on SIGHUP\n"
+                    "-i, --device-id\t:\tDevice id announced to the server (0)\n"
+                    "-m, --channel\t:\tMIDI channel of this keyboard, 0-15 (0)\n"
+                    "-C, --scan-cpu\t:\tCore the scanner thread is pinned to (last core)\n"
+                    "-D, --net-delay\t:\tHold every send of the slow --bench-scan run for N us (5000)\n"
+                    "-b, --bench-scan\t:\tTime N matrix scans, then N paced scans with a fast and a slow network,\n"
+                    "\t\t\tthen play a sim: timeline and check what the scan detected\n"
+                    "-l, --log-file\t:\tLog file (" APP_NAME ".log)\n"
+                    "-p, --pid-file\t:\tPid file (" APP_NAME ".pid)\n"
+                    "-q, --quit\t:\tQuit daemod\n"
+                    "-H, --histograms\t:\tDump scan timing histograms of the running daemon\n"
+                    "-v, --view-log\t:\tView live counters and log action code\n"
+                    "-t, --test\t:\tPlay test note (-t C#3 or -t Db4 or -t E5)\n"
+                    "-h, --help\t:\tPrint this help info\n";
+
+                write(STDOUT_FILENO, help, sizeof(help) - 1);
+            } return SUCCESS_ACTION_CODE;
+        }
+    }
+
+    default_keys(&common.geometry);
+
+    const action_code_t action_code = load_config(&common, common.configs, 0);
+
+    if (UNLIKELY(action_code != SUCCESS_ACTION_CODE)) {
+        return action_code;
+    }
+
+    common.config = common.configs;
+    common.config_published = common.configs;
+    common.gpio = (common.sim_path != NULL ? &sim_backend : &chip_backend);
+
+    if (process == BENCH_PROCESS) {
+        return bench(&common, bench_scans, bench_delay);
     }
 
-    return UNDEFINED_PROCESS_ACTION_CODE;
+    return run_process(&common, process, test_key);
 }